@@ -1,52 +1,756 @@
 #include "allocator.h"
+#include "statistics.h"
 
+#include <pthread.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <cstdint>
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <new>
 
 namespace
 {
-    constexpr static std::size_t const NODE_SIZE = 256;
     constexpr static std::size_t const PAGE_SIZE = 4096;
+    constexpr static std::size_t const CHUNK_SIZE = 16 * PAGE_SIZE;
+
+    //address space reserved up front so that both views keep a constant distance
+    constexpr static std::size_t const REGION_SIZE = 4096 * CHUNK_SIZE;
+
+    //slots cached by every thread, half of them move to or from the global list at once
+    constexpr static std::size_t const MAGAZINE_SIZE = 32;
+
+    constexpr static unsigned const TAG_SHIFT = 48;
+    constexpr static std::uintptr_t const POINTER_MASK = (std::uintptr_t{1} << TAG_SHIFT) - 1;
+
+    static_assert(utils::allocator::min_size << (utils::allocator::size_classes - 1) == utils::allocator::max_size,
+                  "size classes must double up to max_size");
+
+    constexpr std::size_t node_size(std::size_t size_class)
+    {
+        return utils::allocator::min_size << size_class;
+    }
+
+    //free slots are kept as writable addresses,
+    //a slot may be read by a concurrent pop after another thread took it,
+    //so the link is accessed atomically
+    std::atomic<void*>& next(void* slot)
+    {
+        return *static_cast<std::atomic<void*>*>(slot);
+    }
+
+    void* untag(std::uintptr_t head)
+    {
+        return reinterpret_cast<void*>(head & POINTER_MASK);
+    }
+
+    std::uintptr_t retag(void* ptr, std::uintptr_t head)
+    {
+        return reinterpret_cast<std::uintptr_t>(ptr) | (((head >> TAG_SHIFT) + 1) << TAG_SHIFT);
+    }
+
+    char* reserve()
+    {
+        void* region = ::mmap(nullptr, REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED)
+            throw std::bad_alloc{};
+
+        return static_cast<char*>(region);
+    }
+
+    bool map(char* at, std::size_t size, int prot, int fd, std::size_t offset)
+    {
+        int const flags = fd == -1 ? MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED : MAP_SHARED | MAP_FIXED;
+        return ::mmap(at, size, prot, flags, fd, static_cast<off_t>(offset)) != MAP_FAILED;
+    }
+
+    bool write_all(int fd, char const* data, std::size_t size)
+    {
+        for (std::size_t done = 0; done != size;)
+        {
+            ssize_t const written = ::pwrite(fd, data + done, size - done, static_cast<off_t>(done));
+            if (written <= 0)
+                return false;
+
+            done += static_cast<std::size_t>(written);
+        }
+
+        return true;
+    }
+
+    void link(void** slots, std::size_t count)
+    {
+        for (std::size_t i = 1; i < count; ++i)
+            next(slots[i - 1]).store(slots[i], std::memory_order_relaxed);
+    }
 } //namespace
 
 using namespace utils;
 
+struct allocator::magazine
+{
+    void* slots[MAGAZINE_SIZE];
+    std::size_t size = 0;
+    std::size_t size_class = 0;
+
+    //freed slots still in a grace period, sealed MAGAZINE_SIZE / 2 at a time;
+    //their code and functors must stay intact, so they are never linked through themselves
+    struct batch
+    {
+        std::uint64_t epoch;
+        retiree slots[MAGAZINE_SIZE / 2];
+    };
+
+    retiree retired[MAGAZINE_SIZE / 2];
+    std::size_t retired_size = 0;
+
+    //epochs grow along the vector, so reusable batches are a prefix
+    std::vector<batch> sealed;
+    std::size_t sealed_head = 0;
+
+    void release(std::size_t count)
+    {
+        get_instance().taken_slots.fetch_sub(count, std::memory_order_relaxed);
+
+        size -= count;
+        link(slots + size, count);
+        get_instance().push(size_class, slots[size], slots[size + count - 1]);
+    }
+
+    void put(void* slot)
+    {
+        if (size == MAGAZINE_SIZE)
+            release(MAGAZINE_SIZE / 2);
+
+        slots[size++] = slot;
+    }
+
+    bool in_grace() const noexcept
+    {
+        return retired_size != 0 || sealed_head != sealed.size();
+    }
+
+    //destructors of functors are not run while thread locals go away:
+    //every retired slot is left to the other threads, even a reclaimable one
+    ~magazine()
+    {
+        auto& allocator = get_instance();
+
+        if (in_grace())
+        {
+            std::uint64_t const stamp = allocator.epoch.fetch_add(1) + 1;
+
+            std::lock_guard<std::mutex> lock{allocator.orphans_mutex};
+            for (std::size_t i = 0; i != retired_size; ++i)
+                allocator.orphans.emplace_back(stamp, retired[i]);
+            for (std::size_t b = sealed_head; b != sealed.size(); ++b)
+                for (auto const& r : sealed[b].slots)
+                    allocator.orphans.emplace_back(sealed[b].epoch, r);
+
+            allocator.has_orphans.store(true);
+        }
+
+        if (size != 0)
+            release(size);
+    }
+};
+
+//a thread that went online once keeps its record, records are never freed
+//and are taken over by later threads
+struct allocator::reader
+{
+    //0 while offline
+    std::atomic<std::uint64_t> epoch{0};
+    std::atomic<bool> taken{true};
+    reader* next = nullptr;
+};
+
 allocator::allocator()
+    : exec_view{reserve()},
+      write_view{exec_view},
+      fd{::memfd_create("trampoline", MFD_CLOEXEC)},
+      mapped{0},
+      taken_slots{0},
+      peak{0},
+      chunk_classes{},
+      epoch{1},
+      readers_online{0},
+      readers{nullptr},
+      has_orphans{false}
 {
-    head = ::mmap(nullptr, PAGE_SIZE, PROT_EXEC | PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    tail = head;
+    static_assert(sizeof(chunk_classes) == REGION_SIZE / CHUNK_SIZE, "one entry per chunk");
+
+    for (auto& free_list : free_lists)
+        free_list.store(0, std::memory_order_relaxed);
+
+    if (fd != -1)
+        write_view = reserve();
 
-    auto* start = static_cast<char*>(head);
-    for (auto* i = start + NODE_SIZE; i < start + PAGE_SIZE; i += NODE_SIZE)
-        *reinterpret_cast<void**>(i - NODE_SIZE) = i;
+    ::pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
 }
 
 allocator::~allocator()
 {
-    int r = ::munmap(head, PAGE_SIZE);
+    for (reader* r = readers.load(); r;)
+        delete std::exchange(r, r->next);
+
+    int r = ::munmap(exec_view, REGION_SIZE);
     assert(r == 0);
+
+    if (fd != -1)
+    {
+        r = ::munmap(write_view, REGION_SIZE);
+        assert(r == 0);
+
+        ::close(fd);
+    }
 }
 
 allocator& allocator::get_instance()
 {
-    static allocator instance = allocator{};
+    static allocator instance;
     return instance;
 }
 
-void* allocator::allocate()
+allocator::magazine& allocator::local(std::size_t size_class)
 {
-    void* ret = tail;
-    tail = *static_cast<void**>(tail);
-    return ret;
+    thread_local struct magazines
+    {
+        magazine instances[size_classes];
+
+        //thread locals are destroyed in reverse order of construction: attaching
+        //the counters first keeps them owned until the magazines are gone
+        magazines()
+        {
+            thread_counters::local();
+
+            for (std::size_t i = 0; i != size_classes; ++i)
+                instances[i].size_class = i;
+        }
+    } instance;
+
+    return instance.instances[size_class];
+}
+
+allocator::reader*& allocator::local_reader() noexcept
+{
+    thread_local struct handle
+    {
+        reader* instance = nullptr;
+
+        handle()
+        {
+            thread_counters::local();
+        }
+
+        ~handle()
+        {
+            if (instance)
+            {
+                get_instance().offline();
+                instance->taken.store(false);
+            }
+        }
+    } handle;
+
+    return handle.instance;
 }
 
-void allocator::deallocate(void* ptr)
+void allocator::prepare_fork() noexcept
+{
+    auto& self = get_instance();
+
+    self.orphans_mutex.lock();
+    self.grow_mutex.lock();
+}
+
+void allocator::parent_after_fork() noexcept
+{
+    auto& self = get_instance();
+
+    self.grow_mutex.unlock();
+    self.orphans_mutex.unlock();
+}
+
+//runs in the only thread of the child before fork() returns there;
+//the code is taken as it is now, writes of other parent threads in between are not undone
+void allocator::child_after_fork() noexcept
+{
+    auto& self = get_instance();
+
+    if (self.fd != -1)
+    {
+        int const copy = ::memfd_create("trampoline", MFD_CLOEXEC);
+
+        if (copy == -1 || ::ftruncate(copy, static_cast<off_t>(self.mapped)) != 0
+                || !write_all(copy, self.write_view, self.mapped))
+        {
+            //the RWX fallback keeps a private copy as well
+            if (copy != -1)
+                ::close(copy);
+
+            if (self.mapped != 0 && !map(self.exec_view, self.mapped, PROT_READ | PROT_WRITE | PROT_EXEC, -1, 0))
+                std::abort();
+            std::memcpy(self.exec_view, self.write_view, self.mapped);
+
+            ::munmap(self.write_view, REGION_SIZE);
+            ::close(self.fd);
+
+            self.fd = -1;
+            self.write_view = self.exec_view;
+        }
+        else
+        {
+            //both views are replaced at their addresses, a half switched child can not go on
+            if (self.mapped != 0 && (!map(self.exec_view, self.mapped, PROT_READ | PROT_EXEC, copy, 0)
+                                     || !map(self.write_view, self.mapped, PROT_READ | PROT_WRITE, copy, 0)))
+                std::abort();
+
+            ::close(self.fd);
+            self.fd = copy;
+        }
+    }
+
+    //readers of the other parent threads do not exist here and would never
+    //report a quiescent state again: their records are free and offline
+    reader* const mine = local_reader();
+    std::size_t online = 0;
+
+    for (reader* r = self.readers.load(); r; r = r->next)
+    {
+        if (r == mine)
+        {
+            online += r->epoch.load() != 0;
+            continue;
+        }
+
+        r->epoch.store(0);
+        r->taken.store(false);
+    }
+
+    self.readers_online.store(online);
+
+    self.grow_mutex.unlock();
+    self.orphans_mutex.unlock();
+}
+
+std::size_t allocator::size_class_of(void* slot) const noexcept
+{
+    return chunk_classes[static_cast<std::size_t>(static_cast<char*>(slot) - write_view) / CHUNK_SIZE];
+}
+
+void* allocator::pop(std::size_t size_class)
+{
+    auto& free_list = free_lists[size_class];
+    std::uintptr_t head = free_list.load(std::memory_order_acquire);
+
+    for (;;)
+    {
+        void* slot = untag(head);
+        if (!slot)
+            return nullptr;
+
+        void* tail = next(slot).load(std::memory_order_relaxed);
+        if (free_list.compare_exchange_weak(head, retag(tail, head),
+                                            std::memory_order_acquire, std::memory_order_acquire))
+            return slot;
+    }
+}
+
+void allocator::push(std::size_t size_class, void* first, void* last)
+{
+    auto& free_list = free_lists[size_class];
+    std::uintptr_t head = free_list.load(std::memory_order_relaxed);
+
+    do
+        next(last).store(untag(head), std::memory_order_relaxed);
+    while (!free_list.compare_exchange_weak(head, retag(first, head),
+                                            std::memory_order_release, std::memory_order_relaxed));
+}
+
+std::size_t allocator::map_chunks(std::size_t size)
+{
+    if (REGION_SIZE - mapped < size)
+        throw std::bad_alloc{};
+
+    //policies that refuse executable shared mappings get the RWX fallback
+    if (fd != -1 && (::ftruncate(fd, static_cast<off_t>(mapped + size)) != 0
+                     || !map(exec_view + mapped, size, PROT_READ | PROT_EXEC, fd, mapped)
+                     || !map(write_view + mapped, size, PROT_READ | PROT_WRITE, fd, mapped)))
+    {
+        if (mapped != 0)
+            throw std::bad_alloc{};
+
+        ::munmap(write_view, REGION_SIZE);
+        ::close(fd);
+
+        fd = -1;
+        write_view = exec_view;
+    }
+
+    if (fd == -1 && !map(exec_view + mapped, size, PROT_READ | PROT_WRITE | PROT_EXEC, -1, 0))
+        throw std::bad_alloc{};
+
+    std::size_t const offset = mapped;
+    mapped += size;
+    return offset;
+}
+
+void allocator::take(std::size_t count) noexcept
+{
+    std::size_t const now = taken_slots.fetch_add(count, std::memory_order_relaxed) + count;
+
+    std::size_t seen = peak.load(std::memory_order_relaxed);
+    while (seen < now && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed))
+        ;
+}
+
+std::size_t allocator::mapped_bytes()
+{
+    std::lock_guard<std::mutex> lock{grow_mutex};
+    return mapped;
+}
+
+void allocator::grow(std::size_t size_class)
+{
+    std::lock_guard<std::mutex> lock{grow_mutex};
+
+    //somebody else has grown the pool while we were waiting
+    if (untag(free_lists[size_class].load(std::memory_order_acquire)))
+        return;
+
+    std::size_t const offset = map_chunks(CHUNK_SIZE);
+    chunk_classes[offset / CHUNK_SIZE] = static_cast<unsigned char>(size_class);
+
+    auto* start = write_view + offset;
+
+    std::size_t const size = node_size(size_class);
+    for (auto* i = start + size; i < start + CHUNK_SIZE; i += size)
+        next(i - size).store(i, std::memory_order_relaxed);
+
+    push(size_class, start, start + CHUNK_SIZE - size);
+}
+
+void* allocator::allocate(std::size_t size)
+{
+    if (size > max_size)
+        throw std::bad_alloc{};
+
+    std::size_t size_class = 0;
+    while (node_size(size_class) < size)
+        ++size_class;
+
+    magazine& mag = local(size_class);
+
+    //refill half of the magazine from the global list
+    if (mag.size == 0)
+    {
+        while (mag.size < MAGAZINE_SIZE / 2)
+        {
+            void* slot = pop(size_class);
+            if (slot)
+                mag.slots[mag.size++] = slot;
+            else if (mag.size == 0)
+                grow(size_class);
+            else
+                break;
+        }
+
+        take(mag.size);
+    }
+
+    thread_counters::add(thread_counters::local().allocated, 1);
+    return exec_view + (static_cast<char*>(mag.slots[--mag.size]) - write_view);
+}
+
+void allocator::deallocate(void* ptr, destroy_t destroy, void* data)
+{
+    if (!ptr)
+        return;
+
+    void* slot = writable(ptr);
+    magazine& mag = local(size_class_of(slot));
+
+    auto& counters = thread_counters::local();
+    thread_counters::add(counters.deallocated, 1);
+
+    //nobody to wait for: slots of earlier grace periods are free as well
+    if (readers_online.load() == 0)
+    {
+        if (destroy)
+            destroy(data);
+
+        if (mag.in_grace() || has_orphans.load(std::memory_order_relaxed))
+        {
+            //destructors may free other slots into the same magazine
+            retiree retired[MAGAZINE_SIZE / 2];
+            std::size_t const count = std::exchange(mag.retired_size, 0);
+            std::copy(mag.retired, mag.retired + count, retired);
+
+            for (std::size_t i = 0; i != count; ++i)
+                release(mag, retired[i]);
+            thread_counters::add(counters.reclaimed, count);
+
+            reclaim(mag);
+            adopt_orphans(grace_epoch());
+        }
+
+        mag.put(slot);
+        return;
+    }
+
+    mag.retired[mag.retired_size++] = {slot, destroy, data};
+    thread_counters::add(counters.retired, 1);
+    if (mag.retired_size != MAGAZINE_SIZE / 2)
+        return;
+
+    if (mag.sealed_head != 0 && mag.sealed.size() == mag.sealed.capacity())
+    {
+        mag.sealed.erase(mag.sealed.begin(), mag.sealed.begin() + static_cast<std::ptrdiff_t>(mag.sealed_head));
+        mag.sealed_head = 0;
+    }
+
+    try
+    {
+        mag.sealed.push_back({});
+    }
+    catch (std::bad_alloc const&)
+    {
+        //the slots and their functors leak rather than being reused too early
+        mag.retired_size = 0;
+        return;
+    }
+
+    auto& batch = mag.sealed.back();
+    batch.epoch = epoch.fetch_add(1) + 1;
+    std::copy(mag.retired, mag.retired + MAGAZINE_SIZE / 2, batch.slots);
+    mag.retired_size = 0;
+
+    reclaim(mag);
+    if (has_orphans.load(std::memory_order_relaxed))
+        adopt_orphans(grace_epoch());
+}
+
+void allocator::release(magazine& mag, retiree const& r) noexcept
+{
+    if (r.destroy)
+        r.destroy(r.data);
+
+    mag.put(r.slot);
+}
+
+std::uint64_t allocator::grace_epoch() const noexcept
+{
+    std::uint64_t safe = std::numeric_limits<std::uint64_t>::max();
+
+    for (reader* r = readers.load(); r; r = r->next)
+    {
+        std::uint64_t const seen = r->epoch.load();
+        if (seen != 0 && seen < safe)
+            safe = seen;
+    }
+
+    return safe;
+}
+
+void allocator::reclaim(magazine& mag) noexcept
+{
+    std::uint64_t const safe = grace_epoch();
+    auto& counters = thread_counters::local();
+
+    //a batch is taken off before its destructors run, they may free and seal other slots
+    while (mag.sealed_head != mag.sealed.size() && mag.sealed[mag.sealed_head].epoch <= safe)
+    {
+        magazine::batch const done = mag.sealed[mag.sealed_head++];
+
+        for (auto const& r : done.slots)
+            release(mag, r);
+        thread_counters::add(counters.reclaimed, MAGAZINE_SIZE / 2);
+    }
+
+    if (mag.sealed_head == mag.sealed.size())
+    {
+        mag.sealed.clear();
+        mag.sealed_head = 0;
+    }
+}
+
+void allocator::adopt_orphans(std::uint64_t safe) noexcept
+{
+    //taken a few at a time, destructors run without the lock held
+    for (;;)
+    {
+        retiree adopted[MAGAZINE_SIZE / 2];
+        std::size_t count = 0;
+
+        if (!has_orphans.load(std::memory_order_relaxed))
+            return;
+
+        {
+            std::unique_lock<std::mutex> lock{orphans_mutex, std::try_to_lock};
+            if (!lock)
+                return;
+
+            auto kept = orphans.begin();
+            for (auto& orphan : orphans)
+            {
+                if (orphan.first <= safe && count != MAGAZINE_SIZE / 2)
+                    adopted[count++] = orphan.second;
+                else
+                    *kept++ = orphan;
+            }
+
+            orphans.erase(kept, orphans.end());
+            has_orphans.store(!orphans.empty());
+        }
+
+        if (count == 0)
+            return;
+
+        for (std::size_t i = 0; i != count; ++i)
+            release(local(size_class_of(adopted[i].slot)), adopted[i]);
+        thread_counters::add(thread_counters::local().reclaimed, count);
+    }
+}
+
+void allocator::online()
+{
+    reader*& mine = local_reader();
+
+    if (!mine)
+    {
+        for (reader* r = readers.load(); r && !mine; r = r->next)
+        {
+            bool expected = false;
+            if (r->taken.compare_exchange_strong(expected, true))
+                mine = r;
+        }
+
+        if (!mine)
+        {
+            mine = new reader;
+            mine->next = readers.load();
+            while (!readers.compare_exchange_weak(mine->next, mine))
+                ;
+        }
+    }
+
+    if (mine->epoch.load(std::memory_order_relaxed) == 0)
+    {
+        readers_online.fetch_add(1);
+        mine->epoch.store(epoch.load());
+    }
+}
+
+void allocator::quiescent() noexcept
+{
+    reader* mine = local_reader();
+    if (mine && mine->epoch.load(std::memory_order_relaxed) != 0)
+        mine->epoch.store(epoch.load());
+}
+
+void allocator::offline() noexcept
+{
+    reader* mine = local_reader();
+    if (mine && mine->epoch.load(std::memory_order_relaxed) != 0)
+    {
+        mine->epoch.store(0);
+        readers_online.fetch_sub(1);
+    }
+}
+
+void* allocator::allocate_block(std::size_t size)
+{
+    size = (size + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+
+    reclaim_blocks();
+
+    std::lock_guard<std::mutex> lock{grow_mutex};
+
+    //the most recently released block that fits, it is the likeliest to be cached;
+    //the rest of a larger one stays free
+    for (auto i = free_blocks.rbegin(); i != free_blocks.rend(); ++i)
+    {
+        if (i->second < size)
+            continue;
+
+        std::size_t const offset = i->first;
+        if (i->second == size)
+            free_blocks.erase(std::next(i).base());
+        else
+        {
+            i->first += size;
+            i->second -= size;
+        }
+
+        return exec_view + offset;
+    }
+
+    std::size_t const offset = map_chunks(size);
+    for (std::size_t chunk = offset / CHUNK_SIZE; chunk != (offset + size) / CHUNK_SIZE; ++chunk)
+        chunk_classes[chunk] = size_classes;
+
+    return exec_view + offset;
+}
+
+void allocator::deallocate_block(void* ptr, std::size_t size, destroy_block_t destroy, void* data, std::size_t count)
 {
     if (!ptr)
         return;
 
-    *static_cast<void**>(ptr) = tail;
-    tail = static_cast<void**>(ptr);
+    size = (size + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+    std::size_t const offset = static_cast<std::size_t>(static_cast<char*>(ptr) - exec_view);
+
+    if (readers_online.load() != 0)
+    {
+        std::uint64_t const stamp = epoch.fetch_add(1) + 1;
+
+        std::lock_guard<std::mutex> lock{grow_mutex};
+        retired_blocks.push_back({stamp, offset, size, destroy, data, count});
+        return;
+    }
+
+    if (destroy)
+        destroy(data, count);
+
+    {
+        std::lock_guard<std::mutex> lock{grow_mutex};
+        free_blocks.emplace_back(offset, size);
+    }
+
+    reclaim_blocks();
+}
+
+//destructors may release blocks themselves, so they run without grow_mutex
+void allocator::reclaim_blocks()
+{
+    std::uint64_t const safe = grace_epoch();
+
+    for (;;)
+    {
+        retired_block block;
+
+        {
+            std::lock_guard<std::mutex> lock{grow_mutex};
+
+            auto done = std::find_if(retired_blocks.begin(), retired_blocks.end(),
+                                     [safe](retired_block const& b) { return b.epoch <= safe; });
+            if (done == retired_blocks.end())
+                return;
+
+            block = *done;
+            retired_blocks.erase(done);
+        }
+
+        if (block.destroy)
+            block.destroy(block.data, block.count);
+
+        std::lock_guard<std::mutex> lock{grow_mutex};
+        free_blocks.emplace_back(block.offset, block.size);
+    }
 }
@@ -1,27 +1,157 @@
 #ifndef ALLOCATOR_H
 #define ALLOCATOR_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 namespace utils
 {
     class allocator
     {
-        void* tail;
-        void* head;
+    public:
+        //slots come in 32, 64, 128, 256 and 512 bytes, each aligned to its size
+        constexpr static std::size_t const size_classes = 5;
+        constexpr static std::size_t const min_size = 32;
+        constexpr static std::size_t const max_size = 512;
+
+        //run on reclamation, right before the memory may be reused:
+        //the functor of a slot, count functors from data on for a block
+        using destroy_t         = void (*)(void* data);
+        using destroy_block_t   = void (*)(void* data, std::size_t count);
+
+    private:
+        struct magazine;
+        struct reader;
+
+        struct retiree
+        {
+            void* slot;
+            destroy_t destroy;
+            void* data;
+        };
+
+        struct retired_block
+        {
+            std::uint64_t epoch;
+            std::size_t offset;
+            std::size_t size;
+            destroy_block_t destroy;
+            void* data;
+            std::size_t count;
+        };
+
+        //per size class free lists of code slots, linked through their first word;
+        //the upper 16 bits of a head are a version tag against ABA
+        std::atomic<std::uintptr_t> free_lists[size_classes];
+
+        //code pages are mapped twice from one memfd: executable for callers
+        //and writable for the code generator, both views share the offsets;
+        //without memfd both views are a single RWX mapping
+        char* exec_view;
+        char* write_view;
+        int fd;
+
+        std::mutex grow_mutex;
+        std::size_t mapped;
+
+        //slots out of the shared free lists, updated a magazine half at a time
+        std::atomic<std::size_t> taken_slots;
+        std::atomic<std::size_t> peak;
+
+        //every chunk holds slots of a single size class,
+        //chunks of blocks are marked with size_classes
+        unsigned char chunk_classes[4096];
+
+        //grace periods: slots freed while some thread is online are stamped with
+        //a new epoch and reused once every online reader has seen that epoch
+        std::atomic<std::uint64_t> epoch;
+        std::atomic<std::size_t> readers_online;
+        std::atomic<reader*> readers;
+
+        //slots still in their grace period when the thread that freed them exits
+        std::mutex orphans_mutex;
+        std::vector<std::pair<std::uint64_t, retiree>> orphans;
+        std::atomic<bool> has_orphans;
+
+        //released blocks as offsets and sizes, the latest fitting one is reused first
+        std::vector<std::pair<std::size_t, std::size_t>> free_blocks;
+
+        //blocks released while some thread was online, guarded by grow_mutex
+        std::vector<retired_block> retired_blocks;
 
         allocator();
+
+        void* pop(std::size_t size_class);
+        void push(std::size_t size_class, void* first, void* last);
+        void take(std::size_t count) noexcept;
+        void grow(std::size_t size_class);
+        std::size_t map_chunks(std::size_t size);
+
+        std::size_t size_class_of(void* slot) const noexcept;
+
+        //the oldest epoch an online reader may still be in
+        std::uint64_t grace_epoch() const noexcept;
+        void reclaim(magazine& mag) noexcept;
+        void adopt_orphans(std::uint64_t safe) noexcept;
+        void reclaim_blocks();
+
+        static void release(magazine& mag, retiree const& r) noexcept;
+
+        static magazine& local(std::size_t size_class);
+        static reader*& local_reader() noexcept;
+
+        //fork handlers: a child copies the code into a memfd of its own,
+        //shared views would hand out the parent's slots a second time
+        static void prepare_fork() noexcept;
+        static void parent_after_fork() noexcept;
+        static void child_after_fork() noexcept;
     public:
         ~allocator();
 
-        allocator(allocator&&) = default;
-
+        allocator(allocator&&)          = delete;
         allocator(allocator const&)     = delete;
         allocator& operator=(allocator) = delete;
 
         static allocator& get_instance();
 
-        void* allocate();
-        void deallocate(void*);
+        //returns the executable address of the smallest slot that holds size bytes
+        void* allocate(std::size_t size);
+        //the slot is reused, and destroy is run on data, only after
+        //the grace period of online readers
+        void deallocate(void*, destroy_t destroy = nullptr, void* data = nullptr);
+
+        //for utils::collect_statistics
+        std::size_t peak_slots() const noexcept
+        {
+            return peak.load(std::memory_order_relaxed);
+        }
+
+        std::size_t mapped_bytes();
+
+        //quiescent state based reclamation: a thread that runs thunks or keeps
+        //pointers from trampoline::get() while others free them goes online and
+        //reports quiescent states, points where it holds no such pointer;
+        //offline threads, and every thread by default, are not waited for
+        void online();
+        void quiescent() noexcept;
+        void offline() noexcept;
+
+        //whole chunks in a row for bulk users, size is rounded up to 64 KiB;
+        //released blocks go through grace periods like slots do
+        void* allocate_block(std::size_t size);
+        void deallocate_block(void*, std::size_t size,
+                              destroy_block_t destroy = nullptr, void* data = nullptr, std::size_t count = 0);
+
+        //writable alias of an executable address
+        void* writable(void* code) const noexcept
+        {
+            return write_view + (static_cast<char*>(code) - exec_view);
+        }
     };
 } // namespace utils
 
-#endif // ALLOCATOR_H
\ No newline at end of file
+#endif // ALLOCATOR_H
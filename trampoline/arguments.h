@@ -2,87 +2,214 @@
 #define ARGUMENTS_H
 
 #include <cstdint>
+#include <cstddef>
 #include <type_traits>
 
 namespace utils
 {
-    template <std::size_t N, bool B, typename ... Args>
-    struct integral_arguments_counter;
-
-    template <typename Arg, typename ... Args>
-    struct integral_arguments
+    //System V x86-64 classes of the eightbytes an argument is made of
+    enum class eightbyte_class : unsigned char
     {
-        using args = integral_arguments_counter<sizeof... (Args), std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
-
-        constexpr static std::size_t const value = args::value;
+        integer,
+        sse,
+        memory
     };
 
-    template <typename ... Args>
-    struct integral_arguments_counter<0, true, Args ...>
+    struct abi_info
     {
-        constexpr static std::size_t const value = 1;
+        std::size_t eightbytes;
+        std::size_t align;
+        eightbyte_class classes[2];
     };
 
-    template <typename ... Args>
-    struct integral_arguments_counter<0, false, Args ...>
+    template <eightbyte_class ... Classes>
+    struct eightbytes
     {
-        constexpr static std::size_t const value = 0;
+        static_assert(sizeof... (Classes) == 1 || sizeof... (Classes) == 2, "registers take one or two eightbytes");
+
+        constexpr static abi_info const value = {sizeof... (Classes), 8, {Classes ...}};
     };
 
-    template <std::size_t N, typename Arg, typename ... Args>
-    struct integral_arguments_counter<N, true, Arg, Args ...>
+    template <std::size_t Size, std::size_t Align>
+    struct in_memory
     {
-        using args = integral_arguments_counter<N - 1, std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
-
-        constexpr static std::size_t const value = args::value + 1;
+        constexpr static abi_info const value = {(Size + 7) / 8, Align < 8 ? 8 : Align,
+                                                 {eightbyte_class::memory, eightbyte_class::memory}};
     };
 
-    template <std::size_t N, typename Arg, typename ... Args>
-    struct integral_arguments_counter<N, false, Arg, Args ...>
+    //Itanium C++ ABI: a class is passed and returned through a hidden reference when its
+    //copy or move constructor or its destructor is non-trivial, or when it can not be
+    //copied or moved at all; a non-trivial operator= does not matter
+    template <typename T>
+    constexpr static bool const by_invisible_reference =
+            !std::is_trivially_destructible<T>::value
+            || (std::is_copy_constructible<T>::value && !std::is_trivially_copy_constructible<T>::value)
+            || (std::is_move_constructible<T>::value && !std::is_trivially_move_constructible<T>::value)
+            || (!std::is_copy_constructible<T>::value && !std::is_move_constructible<T>::value);
+
+    //classification of a single argument type; the fields of a class can not be
+    //inspected, so other classes of up to 16 bytes need a specialization:
+    //  template <> struct utils::abi_class<point> : utils::eightbytes<utils::eightbyte_class::sse> {};
+    template <typename T, typename = void>
+    struct abi_class
     {
-        using args = integral_arguments_counter<N - 1, std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
-
-        constexpr static std::size_t const value = args::value;
+        static_assert(sizeof(T) == 0, "specialize utils::abi_class for this argument type");
     };
 
-    template <std::size_t N, bool B, typename ... Args>
-    struct floating_arguments_counter;
-
-    template <typename Arg, typename ... Args>
-    struct floating_arguments
+    template <typename T>
+    struct abi_class<T, std::enable_if_t<std::is_reference<T>::value
+                                         || std::is_pointer<T>::value
+                                         || std::is_enum<T>::value
+                                         || std::is_null_pointer<T>::value
+                                         || std::is_member_object_pointer<T>::value
+                                         || (std::is_integral<T>::value && sizeof(T) <= 8)>>
+        : eightbytes<eightbyte_class::integer>
+    {};
+
+    template <typename T>
+    struct abi_class<T, std::enable_if_t<std::is_member_function_pointer<T>::value>>
+        : eightbytes<eightbyte_class::integer, eightbyte_class::integer>
+    {};
+
+    template <>
+    struct abi_class<__int128>
     {
-        using args = floating_arguments_counter<sizeof... (Args), !std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
-
-        constexpr static std::size_t const value = args::value;
+        constexpr static abi_info const value = {2, 16, {eightbyte_class::integer, eightbyte_class::integer}};
     };
 
-    template <typename ... Args>
-    struct floating_arguments_counter<0, true, Args ...>
+    template <>
+    struct abi_class<unsigned __int128> : abi_class<__int128>
+    {};
+
+    template <>
+    struct abi_class<float> : eightbytes<eightbyte_class::sse>
+    {};
+
+    template <>
+    struct abi_class<double> : eightbytes<eightbyte_class::sse>
+    {};
+
+    //x87 values always go to memory
+    template <>
+    struct abi_class<long double> : in_memory<16, 16>
+    {};
+
+    template <typename T>
+    struct abi_class<T, std::enable_if_t<(std::is_class<T>::value || std::is_union<T>::value)
+                                         && by_invisible_reference<T>>>
+        : eightbytes<eightbyte_class::integer>
+    {};
+
+    template <typename T>
+    struct abi_class<T, std::enable_if_t<(std::is_class<T>::value || std::is_union<T>::value)
+                                         && !by_invisible_reference<T> && (sizeof(T) > 16)>>
+        : in_memory<sizeof(T), alignof(T)>
+    {};
+
+    //large results and those of non-trivial classes are written to memory
+    //pointed by a hidden first argument
+    template <typename R>
+    constexpr bool returned_in_memory()
     {
-        constexpr static std::size_t const value = 1;
-    };
+        if constexpr (std::is_class<R>::value || std::is_union<R>::value)
+            return by_invisible_reference<R> || sizeof(R) > 16;
+        else
+            return false;
+    }
 
-    template <typename ... Args>
-    struct floating_arguments_counter<0, false, Args ...>
+    enum class location_kind : unsigned char
     {
-        constexpr static std::size_t const value = 0;
+        integer_register,
+        sse_register,
+        stack
     };
 
-    template <std::size_t N, typename Arg, typename ... Args>
-    struct floating_arguments_counter<N, true, Arg, Args ...>
+    //where an eightbyte is passed: the argument register number (rdi = 0, xmm0 = 0)
+    //or the offset from the first stack argument
+    struct location
     {
-        using args = floating_arguments_counter<N - 1, !std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
-
-        constexpr static std::size_t const value = args::value + 1;
+        location_kind kind;
+        std::size_t index;
     };
 
-    template <std::size_t N, typename Arg, typename ... Args>
-    struct floating_arguments_counter<N, false, Arg, Args ...>
+    constexpr static std::size_t const integer_registers = 6;
+    constexpr static std::size_t const sse_registers = 8;
+
+    template <std::size_t N>
+    struct arguments_layout
     {
-        using args = floating_arguments_counter<N - 1, !std::is_integral<std::remove_reference_t<Arg>>::value, Args ...>;
+        //one extra entry keeps signatures without arguments well-formed
+        location at[N + 1];
+        std::size_t stack_size;
+    };
 
-        constexpr static std::size_t const value = args::value;
+    template <typename R, typename ... Args>
+    struct signature_abi
+    {
+        constexpr static abi_info const arguments[sizeof... (Args) + 1] = {abi_class<std::remove_cv_t<Args>>::value ..., {}};
+        constexpr static std::size_t const eightbytes = (std::size_t{0} + ... + abi_class<std::remove_cv_t<Args>>::value.eightbytes);
+
+        //assigns registers and stack slots the way the caller does,
+        //hidden is the number of integer registers taken before Args
+        constexpr static arguments_layout<eightbytes> layout(std::size_t hidden)
+        {
+            arguments_layout<eightbytes> result{};
+
+            std::size_t integers = hidden;
+            std::size_t sses = 0;
+            std::size_t stack = 0;
+            std::size_t k = 0;
+
+            for (std::size_t i = 0; i != sizeof... (Args); ++i)
+            {
+                abi_info const& arg = arguments[i];
+
+                std::size_t need_integers = 0;
+                std::size_t need_sses = 0;
+
+                bool const memory = arg.classes[0] == eightbyte_class::memory;
+
+                for (std::size_t e = 0; !memory && e != arg.eightbytes; ++e)
+                {
+                    if (arg.classes[e] == eightbyte_class::integer)
+                        ++need_integers;
+                    else
+                        ++need_sses;
+                }
+
+                //an argument is never split between registers and the stack
+                if (!memory && integers + need_integers <= integer_registers && sses + need_sses <= sse_registers)
+                {
+                    for (std::size_t e = 0; e != arg.eightbytes; ++e, ++k)
+                    {
+                        if (arg.classes[e] == eightbyte_class::integer)
+                            result.at[k] = {location_kind::integer_register, integers++};
+                        else
+                            result.at[k] = {location_kind::sse_register, sses++};
+                    }
+                }
+                else
+                {
+                    stack = (stack + arg.align - 1) / arg.align * arg.align;
+
+                    for (std::size_t e = 0; e != arg.eightbytes; ++e, ++k, stack += 8)
+                        result.at[k] = {location_kind::stack, stack};
+                }
+            }
+
+            result.stack_size = stack;
+            return result;
+        }
+
+        //a sret pointer comes first for both layouts
+        constexpr static std::size_t const hidden = returned_in_memory<R>() ? 1 : 0;
+
+        //Args as the caller of the thunk passes them
+        constexpr static arguments_layout<eightbytes> const caller = layout(hidden);
+
+        //Args behind the inserted functor pointer, as do_call expects them
+        constexpr static arguments_layout<eightbytes> const callee = layout(hidden + 1);
     };
 } //namespace utils
 
-#endif // ARGUMENTS_H
\ No newline at end of file
+#endif // ARGUMENTS_H
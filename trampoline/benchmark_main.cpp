@@ -0,0 +1,488 @@
+#include "trampoline.h"
+#include "trampoline_pool.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    using clock_type = std::chrono::steady_clock;
+
+    double seconds_since(clock_type::time_point start)
+    {
+        return std::chrono::duration<double>(clock_type::now() - start).count();
+    }
+
+    //creates and destroys batches of trampolines, returns trampolines per second
+    double creation_throughput(std::size_t threads_count)
+    {
+        std::size_t const rounds = 2000;
+        std::size_t const batch = 64;
+
+        auto start = clock_type::now();
+
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t != threads_count; ++t)
+        {
+            threads.emplace_back([=]
+            {
+                std::vector<trampoline<int (int)>> trampolines;
+                trampolines.reserve(batch);
+
+                for (std::size_t r = 0; r != rounds; ++r)
+                {
+                    for (std::size_t i = 0; i != batch; ++i)
+                        trampolines.emplace_back([i](int a) { return a + static_cast<int>(i); });
+
+                    trampolines.clear();
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        return static_cast<double>(threads_count * rounds * batch) / seconds_since(start);
+    }
+
+    struct in_slot_functor
+    {
+        int value;
+
+        int operator()(int a) const
+        {
+            return a + value;
+        }
+    };
+
+    //same functor, but a throwing move keeps it out of the code slot
+    struct on_heap_functor
+    {
+        int value;
+
+        on_heap_functor(int value)
+            : value{value}
+        {}
+
+        on_heap_functor(on_heap_functor const& that) noexcept(false)
+            : value{that.value}
+        {}
+
+        int operator()(int a) const
+        {
+            return a + value;
+        }
+    };
+
+    volatile int sink;
+
+    //nanoseconds per construction and destruction
+    template <typename F>
+    double construction_latency(F const& func)
+    {
+        std::size_t const iterations = 1000000;
+        auto start = clock_type::now();
+
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            trampoline<int (int)> tr{F{func}};
+            sink = tr ? 1 : 0;
+        }
+
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //same, with the calling thread online and quiescent between constructions,
+    //so that every freed slot goes through a grace period
+    double construction_latency_online()
+    {
+        auto& allocator = utils::allocator::get_instance();
+        allocator.online();
+
+        std::size_t const iterations = 1000000;
+        auto start = clock_type::now();
+
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            trampoline<int (int)> tr{in_slot_functor{1}};
+            sink = tr ? 1 : 0;
+            allocator.quiescent();
+        }
+
+        double const result = seconds_since(start) * 1e9 / iterations;
+        allocator.offline();
+        return result;
+    }
+
+    using eight_t = long long (int, int, int, int, int, int, int, int);
+
+    struct eight_functor
+    {
+        long k;
+
+        long long operator()(int a, int b, int c, int d, int e, int f, int g, int h) const
+        {
+            return k + a + b + c + d + e + f + g + h;
+        }
+    };
+
+    //nanoseconds per construction and destruction of an 8 argument trampoline
+    template <typename ... Mode>
+    double eight_construction_latency(Mode ... mode)
+    {
+        std::size_t const iterations = 1000000;
+        auto start = clock_type::now();
+
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            trampoline<eight_t> tr{mode ..., eight_functor{1}};
+            sink = tr ? 1 : 0;
+        }
+
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //nanoseconds per call through the raw pointer,
+    //the callbacks are spread over many trampolines like in an event loop
+    template <typename F>
+    double call_latency(F const& func)
+    {
+        std::size_t const callbacks = 4096;
+        std::size_t const rounds = 1000;
+
+        std::vector<trampoline<int (int)>> trampolines;
+        std::vector<int (*)(int)> pointers;
+        for (std::size_t i = 0; i != callbacks; ++i)
+        {
+            trampolines.emplace_back(F{func});
+            pointers.push_back(trampolines.back().get());
+        }
+
+        auto start = clock_type::now();
+
+        int sum = 0;
+        for (std::size_t r = 0; r != rounds; ++r)
+            for (auto* p : pointers)
+                sum += p(static_cast<int>(r));
+
+        sink = sum;
+        return seconds_since(start) * 1e9 / (callbacks * rounds);
+    }
+
+    //nanoseconds per callback to build and tear down a table of callbacks,
+    //one trampoline each or a single pool
+    template <bool Pooled>
+    double callback_table_latency(std::size_t callbacks)
+    {
+        std::size_t const rounds = 100;
+        auto start = clock_type::now();
+
+        for (std::size_t r = 0; r != rounds; ++r)
+        {
+            if constexpr (Pooled)
+            {
+                trampoline_pool<int (int), in_slot_functor> pool{callbacks};
+                for (std::size_t i = 0; i != callbacks; ++i)
+                    pool.push_back(in_slot_functor{static_cast<int>(i)});
+                sink = pool[0](1);
+            }
+            else
+            {
+                std::vector<trampoline<int (int)>> table;
+                table.reserve(callbacks);
+                for (std::size_t i = 0; i != callbacks; ++i)
+                    table.emplace_back(in_slot_functor{static_cast<int>(i)});
+                sink = table[0](1);
+            }
+        }
+
+        return seconds_since(start) * 1e9 / (rounds * callbacks);
+    }
+
+    //same as in_slot_functor, but the parameter conversion needs do_call
+    struct converting_functor
+    {
+        int value;
+
+        int operator()(long a) const
+        {
+            return static_cast<int>(a) + value;
+        }
+    };
+
+    int plain_function(int a)
+    {
+        return a + 1;
+    }
+
+    //nanoseconds per call of a single hot callback, kept out of line
+    //so that the target is not known to the loop
+    template <typename C>
+    __attribute__((noinline)) double hot_call_latency(C const& call)
+    {
+        std::size_t const iterations = 100000000;
+        auto start = clock_type::now();
+
+        int sum = 0;
+        for (std::size_t i = 0; i != iterations; ++i)
+            sum += call(static_cast<int>(i));
+
+        sink = sum;
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //sums its arguments, the same work for every way of calling it
+    template <typename R, typename ... Args>
+    struct summing_functor
+    {
+        long k;
+
+        R operator()(Args ... args) const
+        {
+            return static_cast<R>((static_cast<double>(k) + ... + static_cast<double>(args)));
+        }
+    };
+
+    template <typename R, typename ... Args>
+    __attribute__((noinline)) R summing_function(Args ... args)
+    {
+        return summing_functor<R, Args ...>{1}(args ...);
+    }
+
+    //nanoseconds per call with arguments that change every iteration
+    template <typename R, typename ... Args, typename C>
+    __attribute__((noinline)) double signature_call_latency(C const& call)
+    {
+        std::size_t const iterations = 20000000;
+        auto start = clock_type::now();
+
+        R sum{};
+        for (std::size_t i = 0; i != iterations; ++i)
+            sum += call(static_cast<Args>(i) ...);
+
+        sink = static_cast<int>(sum);
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //nanoseconds per move construction plus move assignment
+    double move_latency()
+    {
+        std::size_t const iterations = 10000000;
+
+        trampoline<int (int)> a = in_slot_functor{1};
+        trampoline<int (int)> b;
+
+        auto start = clock_type::now();
+
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            trampoline<int (int)> c{std::move(a)};
+            b = std::move(c);
+            a = std::move(b);
+        }
+
+        sink = a(1);
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //calls per second, every thread calling its own callbacks
+    double call_throughput(std::size_t threads_count)
+    {
+        std::size_t const callbacks = 256;
+        std::size_t const rounds = 40000;
+
+        auto start = clock_type::now();
+
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t != threads_count; ++t)
+        {
+            threads.emplace_back([=]
+            {
+                std::vector<trampoline<int (int)>> trampolines;
+                for (std::size_t i = 0; i != callbacks; ++i)
+                    trampolines.emplace_back(in_slot_functor{static_cast<int>(i)});
+
+                int sum = 0;
+                for (std::size_t r = 0; r != rounds; ++r)
+                    for (auto& tr : trampolines)
+                        sum += tr.get()(static_cast<int>(r));
+
+                sink = sum;
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        return static_cast<double>(threads_count * callbacks * rounds) / seconds_since(start);
+    }
+
+    //passed in memory, every copy on the way is 128 bytes
+    struct large_argument
+    {
+        long values[16];
+    };
+
+    struct large_argument_functor
+    {
+        long k;
+
+        long operator()(large_argument a) const
+        {
+            return k + a.values[0] + a.values[15];
+        }
+    };
+
+    long large_argument_function(large_argument a)
+    {
+        return a.values[0] + a.values[15];
+    }
+
+    //nanoseconds per trampoline::operator() call with a large by-value argument
+    __attribute__((noinline)) double large_argument_latency(trampoline<long (large_argument)> const& tr)
+    {
+        std::size_t const iterations = 20000000;
+        large_argument a{};
+
+        auto start = clock_type::now();
+
+        long sum = 0;
+        for (std::size_t i = 0; i != iterations; ++i)
+        {
+            a.values[0] = static_cast<long>(i);
+            sum += tr(a);
+        }
+
+        sink = static_cast<int>(sum);
+        return seconds_since(start) * 1e9 / iterations;
+    }
+
+    //results as text, or as a JSON array with --json
+    struct report_t
+    {
+        struct result
+        {
+            std::string name;
+            double value;
+            std::string unit;
+        };
+
+        std::vector<result> results;
+
+        void operator()(std::string name, double value, std::string unit)
+        {
+            results.push_back({std::move(name), value, std::move(unit)});
+        }
+
+        void print(bool json) const
+        {
+            if (!json)
+            {
+                for (auto const& r : results)
+                    std::cout << r.name << ": " << r.value << ' ' << r.unit << '\n';
+                return;
+            }
+
+            std::cout << "[\n";
+            for (std::size_t i = 0; i != results.size(); ++i)
+                std::cout << "  {\"name\": \"" << results[i].name << "\", \"value\": " << results[i].value
+                          << ", \"unit\": \"" << results[i].unit << "\"}" << (i + 1 != results.size() ? ",\n" : "\n");
+            std::cout << "]\n";
+        }
+    };
+
+    //every way of calling one signature
+    template <typename R, typename ... Args>
+    void signature_calls(report_t& report, std::string const& signature)
+    {
+        using functor = summing_functor<R, Args ...>;
+
+        trampoline<R (Args ...)> tr = functor{1};
+        auto pointer = tr.get();
+        std::function<R (Args ...)> function = functor{1};
+        R (*plain)(Args ...) = summing_function<R, Args ...>;
+
+        report("call, " + signature + ", trampoline operator()", signature_call_latency<R, Args ...>(tr), "ns");
+        report("call, " + signature + ", trampoline get()", signature_call_latency<R, Args ...>(pointer), "ns");
+        report("call, " + signature + ", std::function", signature_call_latency<R, Args ...>(function), "ns");
+        report("call, " + signature + ", function pointer", signature_call_latency<R, Args ...>(plain), "ns");
+        report("call, " + signature + ", direct", signature_call_latency<R, Args ...>(functor{1}), "ns");
+    }
+} //namespace
+
+int main(int argc, char* argv[])
+{
+    bool const json = argc > 1 && std::string{argv[1]} == "--json";
+    report_t report;
+
+    for (std::size_t threads : {1, 2, 4, 8})
+        report("creation, " + std::to_string(threads) + " threads", creation_throughput(threads), "trampolines/s");
+
+    for (std::size_t threads : {1, 2, 4, 8})
+        report("call, " + std::to_string(threads) + " threads", call_throughput(threads), "calls/s");
+
+    report("construction, functor in slot", construction_latency(in_slot_functor{1}), "ns");
+    report("construction, functor on heap", construction_latency(on_heap_functor{1}), "ns");
+    report("construction, functor in slot, reader online", construction_latency_online(), "ns");
+    report("move", move_latency(), "ns");
+    report("call, functor in slot", call_latency(in_slot_functor{1}), "ns");
+    report("call, functor on heap", call_latency(on_heap_functor{1}), "ns");
+
+    report("callback table of 20000, trampolines", callback_table_latency<false>(20000), "ns per callback");
+    report("callback table of 20000, pool", callback_table_latency<true>(20000), "ns per callback");
+
+    trampoline<int (int)> direct = in_slot_functor{1};
+    trampoline<int (int)> indirect = converting_functor{1};
+    std::function<int (int)> function = in_slot_functor{1};
+    int (*pointer)(int) = plain_function;
+
+    trampoline<eight_t> eight = eight_functor{1};
+    trampoline<eight_t> eight_chained{utils::static_chain, eight_functor{1}};
+    auto eight_pointer = eight.get();
+    auto eight_chained_pointer = eight_chained.get();
+
+    report("construction, 8 integral arguments", eight_construction_latency(), "ns");
+    report("construction, 8 integral arguments, static chain", eight_construction_latency(utils::static_chain), "ns");
+
+    report("hot call, 8 integral arguments",
+           hot_call_latency([eight_pointer](int a) { return static_cast<int>(eight_pointer(a, 1, 2, 3, 4, 5, 6, 7)); }),
+           "ns");
+    report("hot call, 8 integral arguments, static chain",
+           hot_call_latency([eight_chained_pointer](int a) { return static_cast<int>(eight_chained_pointer(a, 1, 2, 3, 4, 5, 6, 7)); }),
+           "ns");
+
+    report("hot call, trampoline direct", hot_call_latency(direct.get()), "ns");
+    report("hot call, trampoline via do_call", hot_call_latency(indirect.get()), "ns");
+    report("hot call, std::function", hot_call_latency(function), "ns");
+    report("hot call, function pointer", hot_call_latency(pointer), "ns");
+
+    signature_calls<long, long>(report, "1 long");
+    signature_calls<long, long, long>(report, "2 long");
+    signature_calls<long, long, long, long>(report, "3 long");
+    signature_calls<long, long, long, long, long>(report, "4 long");
+    signature_calls<long, long, long, long, long, long>(report, "5 long");
+    signature_calls<long, long, long, long, long, long, long>(report, "6 long");
+    signature_calls<long, long, long, long, long, long, long, long>(report, "7 long");
+    signature_calls<long, long, long, long, long, long, long, long, long>(report, "8 long");
+    signature_calls<double, int, double>(report, "int double");
+    signature_calls<double, float, int, double, long>(report, "float int double long");
+    signature_calls<double, double, double, double, double, int, int, int, int>(report, "4 double 4 int");
+    signature_calls<double, int, float, int, float, int, float, int, float>(report, "8 alternating int float");
+
+    report("operator(), 128 byte argument, functor", large_argument_latency(large_argument_functor{1}), "ns");
+    report("operator(), 128 byte argument, function pointer", large_argument_latency(large_argument_function), "ns");
+
+    auto const stats = utils::collect_statistics();
+    report("statistics, peak slots", static_cast<double>(stats.peak_slots), "slots");
+    report("statistics, mapped", static_cast<double>(stats.mapped_bytes), "bytes");
+    report("statistics, constructed", static_cast<double>(stats.constructed), "trampolines");
+
+    report.print(json);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,359 @@
+#include "jit_symbols.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <system_error>
+
+//GDB JIT interface: the debugger breaks in __jit_debug_register_code
+//and reads the object file of the relevant entry
+extern "C"
+{
+    enum jit_actions_t : std::uint32_t
+    {
+        JIT_NOACTION = 0,
+        JIT_REGISTER_FN,
+        JIT_UNREGISTER_FN
+    };
+
+    struct jit_code_entry
+    {
+        jit_code_entry* next_entry;
+        jit_code_entry* prev_entry;
+        char const* symfile_addr;
+        std::uint64_t symfile_size;
+    };
+
+    struct jit_descriptor
+    {
+        std::uint32_t version;
+        std::uint32_t action_flag;
+        jit_code_entry* relevant_entry;
+        jit_code_entry* first_entry;
+    };
+
+    void __attribute__((noinline)) __jit_debug_register_code()
+    {
+        asm volatile ("" ::: "memory");
+    }
+
+    jit_descriptor __jit_debug_descriptor = {1, JIT_NOACTION, nullptr, nullptr};
+}
+
+namespace
+{
+    //little endian writer for the object file
+    struct image_t
+    {
+        std::string bytes;
+
+        void put(std::uint64_t value, std::size_t size)
+        {
+            for (std::size_t i = 0; i != size; ++i)
+                bytes.push_back(static_cast<char>(value >> (8 * i) & 0xff));
+        }
+
+        void uleb(std::uint64_t value)
+        {
+            do
+            {
+                unsigned char b = value & 0x7f;
+                value >>= 7;
+                bytes.push_back(static_cast<char>(value ? b | 0x80 : b));
+            }
+            while (value);
+        }
+
+        void align(std::size_t alignment, char fill = 0)
+        {
+            while (bytes.size() % alignment)
+                bytes.push_back(fill);
+        }
+
+        template <typename T>
+        void append(T const& value)
+        {
+            bytes.append(reinterpret_cast<char const*>(&value), sizeof(value));
+        }
+    };
+
+    constexpr static unsigned char const DW_CFA_nop = 0x00;
+    constexpr static unsigned char const DW_CFA_advance_loc = 0x40;
+    constexpr static unsigned char const DW_CFA_advance_loc1 = 0x02;
+    constexpr static unsigned char const DW_CFA_advance_loc2 = 0x03;
+    constexpr static unsigned char const DW_CFA_offset = 0x80;
+    constexpr static unsigned char const DW_CFA_def_cfa = 0x0c;
+    constexpr static unsigned char const DW_CFA_def_cfa_offset = 0x0e;
+
+    //DWARF numbers of rsp and of the return address column
+    constexpr static unsigned char const RSP = 7;
+    constexpr static unsigned char const RIP = 16;
+
+    void advance(image_t& out, std::size_t delta)
+    {
+        if (delta < 0x40)
+            out.put(DW_CFA_advance_loc | delta, 1);
+        else if (delta < 0x100)
+        {
+            out.put(DW_CFA_advance_loc1, 1);
+            out.put(delta, 1);
+        }
+        else
+        {
+            out.put(DW_CFA_advance_loc2, 1);
+            out.put(delta, 2);
+        }
+    }
+
+    //a CIE for the state at entry, CFA = rsp + 8 with the return address below it,
+    //and an FDE that follows the frame of the call path
+    std::string debug_frame(void const* code, std::size_t size, utils::thunk_frame const& frame)
+    {
+        image_t out;
+
+        out.put(0, 4);
+        out.put(0xffffffff, 4);                                     //CIE id
+        out.put(1, 1);                                              //version
+        out.put(0, 1);                                              //no augmentation
+        out.uleb(1);                                                //code alignment
+        out.put(0x78, 1);                                           //data alignment -8
+        out.put(RIP, 1);
+        out.put(DW_CFA_def_cfa, 1);
+        out.put(RSP, 1);
+        out.put(8, 1);
+        out.put(DW_CFA_offset | RIP, 1);
+        out.uleb(1);
+        out.align(8, DW_CFA_nop);
+
+        auto cie_length = static_cast<std::uint32_t>(out.bytes.size() - 4);
+        std::memcpy(&out.bytes[0], &cie_length, 4);
+
+        std::size_t const fde = out.bytes.size();
+        out.put(0, 4);
+        out.put(0, 4);                                              //CIE offset
+        out.put(reinterpret_cast<std::uintptr_t>(code), 8);
+        out.put(size, 8);
+
+        if (frame.size != 0)
+        {
+            advance(out, frame.begin);
+            out.put(DW_CFA_def_cfa_offset, 1);
+            out.uleb(frame.size + 8);
+            advance(out, frame.end - frame.begin);
+            out.put(DW_CFA_def_cfa_offset, 1);
+            out.uleb(8);
+        }
+        out.align(8, DW_CFA_nop);
+
+        auto fde_length = static_cast<std::uint32_t>(out.bytes.size() - fde - 4);
+        std::memcpy(&out.bytes[fde], &fde_length, 4);
+
+        return out.bytes;
+    }
+
+    //a relocatable object whose .text is placed at the thunk, the way JIT
+    //compilers hand their code to GDB: symbols are section relative
+    std::string elf_image(void const* code, std::size_t size, std::string const& name, utils::thunk_frame const& frame)
+    {
+        enum : unsigned
+        {
+            null_section,
+            text_section,
+            frame_section,
+            symtab_section,
+            strtab_section,
+            shstrtab_section,
+            sections_count
+        };
+
+        char const shstrtab[] = "\0.text\0.debug_frame\0.symtab\0.strtab\0.shstrtab";
+        Elf64_Word const names[sections_count] = {0, 1, 7, 20, 28, 36};
+
+        image_t out;
+        out.bytes.resize(sizeof(Elf64_Ehdr));
+
+        Elf64_Shdr headers[sections_count] = {};
+        auto const section = [&out, &headers, &names](unsigned index, Elf64_Word type, std::string const& contents,
+                                                      std::size_t alignment)
+        {
+            out.align(alignment);
+
+            headers[index].sh_name = names[index];
+            headers[index].sh_type = type;
+            headers[index].sh_offset = out.bytes.size();
+            headers[index].sh_size = contents.size();
+            headers[index].sh_addralign = alignment;
+
+            out.bytes += contents;
+        };
+
+        section(text_section, SHT_PROGBITS, std::string(static_cast<char const*>(code), size), 16);
+        headers[text_section].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+        headers[text_section].sh_addr = reinterpret_cast<std::uintptr_t>(code);
+
+        section(frame_section, SHT_PROGBITS, debug_frame(code, size, frame), 8);
+
+        Elf64_Sym symbols[2] = {};
+        symbols[1].st_name = 1;
+        symbols[1].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_FUNC);
+        symbols[1].st_shndx = text_section;
+        symbols[1].st_size = size;
+
+        section(symtab_section, SHT_SYMTAB, std::string(reinterpret_cast<char const*>(symbols), sizeof(symbols)), 8);
+        headers[symtab_section].sh_link = strtab_section;
+        headers[symtab_section].sh_info = 1;
+        headers[symtab_section].sh_entsize = sizeof(Elf64_Sym);
+
+        section(strtab_section, SHT_STRTAB, std::string(1, '\0') + name + '\0', 1);
+        section(shstrtab_section, SHT_STRTAB, std::string(shstrtab, sizeof(shstrtab)), 1);
+
+        out.align(8);
+        std::size_t const headers_at = out.bytes.size();
+        for (auto const& header : headers)
+            out.append(header);
+
+        Elf64_Ehdr ehdr = {};
+        std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+        ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+        ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+        ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+        ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        ehdr.e_type = ET_REL;
+        ehdr.e_machine = EM_X86_64;
+        ehdr.e_version = EV_CURRENT;
+        ehdr.e_shoff = headers_at;
+        ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+        ehdr.e_shentsize = sizeof(Elf64_Shdr);
+        ehdr.e_shnum = sections_count;
+        ehdr.e_shstrndx = shstrtab_section;
+        std::memcpy(&out.bytes[0], &ehdr, sizeof(ehdr));
+
+        return out.bytes;
+    }
+} //namespace
+
+using namespace utils;
+
+struct jit_symbols::entry
+{
+    jit_code_entry link;
+    std::string image;
+};
+
+jit_symbols::jit_symbols()
+    : modes{0},
+      perf_file{nullptr}
+{}
+
+jit_symbols::~jit_symbols()
+{
+    for (auto& code_entry : entries)
+        unlink(code_entry.second);
+
+    if (perf_file)
+        std::fclose(perf_file);
+}
+
+jit_symbols& jit_symbols::get_instance()
+{
+    static jit_symbols instance;
+    return instance;
+}
+
+void jit_symbols::enable(unsigned modes)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if ((modes & perf_map) && !perf_file)
+    {
+        std::string const path = "/tmp/perf-" + std::to_string(::getpid()) + ".map";
+
+        perf_file = std::fopen(path.c_str(), "a");
+        if (!perf_file)
+            throw std::system_error{errno, std::generic_category(), path};
+    }
+
+    this->modes.fetch_or(modes);
+}
+
+void jit_symbols::add(void const* code, std::size_t size, std::string const& name, thunk_frame const& frame)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    unsigned const current = modes.load(std::memory_order_relaxed);
+
+    if (current & perf_map)
+    {
+        std::fprintf(perf_file, "%lx %zx %s\n", static_cast<unsigned long>(reinterpret_cast<std::uintptr_t>(code)),
+                     size, name.c_str());
+        std::fflush(perf_file);
+    }
+
+    if (!(current & gdb_jit))
+        return;
+
+    auto* e = new entry{{}, elf_image(code, size, name, frame)};
+    e->link.symfile_addr = e->image.data();
+    e->link.symfile_size = e->image.size();
+
+    //a slot reused without remove() loses its old description
+    auto& known = entries[code];
+    if (known)
+        unlink(known);
+    known = e;
+
+    e->link.next_entry = __jit_debug_descriptor.first_entry;
+    if (e->link.next_entry)
+        e->link.next_entry->prev_entry = &e->link;
+    __jit_debug_descriptor.first_entry = &e->link;
+
+    __jit_debug_descriptor.relevant_entry = &e->link;
+    __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+    __jit_debug_register_code();
+}
+
+void jit_symbols::remove(void const* code) noexcept
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    auto it = entries.find(code);
+    if (it == entries.end())
+        return;
+
+    unlink(it->second);
+    entries.erase(it);
+}
+
+void jit_symbols::unlink(entry* e) noexcept
+{
+    if (e->link.prev_entry)
+        e->link.prev_entry->next_entry = e->link.next_entry;
+    else
+        __jit_debug_descriptor.first_entry = e->link.next_entry;
+
+    if (e->link.next_entry)
+        e->link.next_entry->prev_entry = e->link.prev_entry;
+
+    __jit_debug_descriptor.relevant_entry = &e->link;
+    __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+
+    delete e;
+}
+
+std::string utils::demangle(char const* name)
+{
+    int status = 0;
+    char* readable = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+
+    if (status != 0 || !readable)
+        return name;
+
+    std::string result = readable;
+    std::free(readable);
+    return result;
+}
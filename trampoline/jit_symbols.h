@@ -0,0 +1,68 @@
+#ifndef JIT_SYMBOLS_H
+#define JIT_SYMBOLS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace utils
+{
+    //stack frame of a thunk for unwinders: none when size is 0,
+    //otherwise rsp is size bytes lower from offset begin up to offset end
+    struct thunk_frame
+    {
+        std::size_t size;
+        std::size_t begin;
+        std::size_t end;
+    };
+
+    //opt-in names for generated code: /tmp/perf-<pid>.map lines for perf
+    //and in-memory ELF objects with a symbol and CFI for the GDB JIT interface
+    class jit_symbols
+    {
+    public:
+        constexpr static unsigned const perf_map = 1;
+        constexpr static unsigned const gdb_jit = 2;
+
+    private:
+        struct entry;
+
+        std::atomic<unsigned> modes;
+
+        std::mutex mutex;
+        std::FILE* perf_file;
+        std::unordered_map<void const*, entry*> entries;
+
+        jit_symbols();
+
+        void unlink(entry* e) noexcept;
+
+    public:
+        ~jit_symbols();
+
+        jit_symbols(jit_symbols&&)          = delete;
+        jit_symbols(jit_symbols const&)     = delete;
+        jit_symbols& operator=(jit_symbols) = delete;
+
+        static jit_symbols& get_instance();
+
+        //modes can only be added, code made before is not described
+        void enable(unsigned modes);
+
+        bool enabled() const noexcept
+        {
+            return modes.load(std::memory_order_relaxed) != 0;
+        }
+
+        void add(void const* code, std::size_t size, std::string const& name, thunk_frame const& frame);
+        void remove(void const* code) noexcept;
+    };
+
+    //readable form of a typeid name, the name itself when it can not be demangled
+    std::string demangle(char const* name);
+} //namespace utils
+
+#endif // JIT_SYMBOLS_H
@@ -0,0 +1,98 @@
+#include "statistics.h"
+#include "allocator.h"
+
+#include <new>
+#include <ostream>
+
+namespace
+{
+    //blocks are never freed: a new thread takes over the block of an exited one
+    //and keeps adding to its counters
+    std::atomic<utils::thread_counters*> blocks{nullptr};
+
+    //shared by threads that could not get a block of their own
+    utils::thread_counters overflow;
+
+    std::size_t sum(std::atomic<std::size_t> utils::thread_counters::* counter)
+    {
+        std::size_t result = 0;
+        for (auto* block = blocks.load(std::memory_order_acquire); block; block = block->next)
+            result += (block->*counter).load(std::memory_order_relaxed);
+
+        return result + (overflow.*counter).load(std::memory_order_relaxed);
+    }
+} //namespace
+
+using namespace utils;
+
+thread_counters* thread_counters::attach() noexcept
+{
+    thread_counters* mine = nullptr;
+
+    for (auto* block = blocks.load(std::memory_order_acquire); block && !mine; block = block->next)
+    {
+        bool expected = false;
+        if (block->taken.compare_exchange_strong(expected, true))
+            mine = block;
+    }
+
+    if (!mine)
+    {
+        mine = new (std::nothrow) thread_counters;
+        if (!mine)
+            return &overflow;
+
+        mine->next = blocks.load(std::memory_order_relaxed);
+        while (!blocks.compare_exchange_weak(mine->next, mine, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+
+    //destroyed after the thread locals of the allocator, they attach first
+    thread_local struct handle
+    {
+        thread_counters* block;
+
+        ~handle()
+        {
+            block->taken.store(false);
+        }
+    } handle{mine};
+
+    return mine;
+}
+
+statistics utils::collect_statistics()
+{
+    statistics result = {};
+
+    //frees may be counted by other threads than allocations,
+    //they are summed first so that a concurrent pair can not underflow
+    std::size_t const deallocated = sum(&thread_counters::deallocated);
+    std::size_t const reclaimed = sum(&thread_counters::reclaimed);
+    std::size_t const heap_freed = sum(&thread_counters::heap_freed);
+
+    result.live_slots = sum(&thread_counters::allocated) - deallocated;
+    result.retired_slots = sum(&thread_counters::retired) - reclaimed;
+    result.functor_heap_bytes = sum(&thread_counters::heap_allocated) - heap_freed;
+    result.constructed = sum(&thread_counters::constructed);
+    result.destroyed = sum(&thread_counters::destroyed);
+    result.code_bytes = sum(&thread_counters::code_bytes);
+
+    auto& allocator = allocator::get_instance();
+    result.peak_slots = allocator.peak_slots();
+    result.mapped_bytes = allocator.mapped_bytes();
+
+    return result;
+}
+
+std::ostream& utils::operator<<(std::ostream& out, statistics const& stats)
+{
+    return out << "live slots: " << stats.live_slots << '\n'
+               << "retired slots: " << stats.retired_slots << '\n'
+               << "peak slots: " << stats.peak_slots << '\n'
+               << "mapped bytes: " << stats.mapped_bytes << '\n'
+               << "constructed: " << stats.constructed << '\n'
+               << "destroyed: " << stats.destroyed << '\n'
+               << "functor heap bytes: " << stats.functor_heap_bytes << '\n'
+               << "code bytes: " << stats.code_bytes << '\n';
+}
@@ -0,0 +1,77 @@
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <iosfwd>
+
+namespace utils
+{
+    //a snapshot of the allocator and of trampolines with generated code,
+    //counters of exited threads are kept
+    struct statistics
+    {
+        //slots handed out and not freed yet
+        std::size_t live_slots;
+
+        //freed slots waiting for the grace period of online readers
+        std::size_t retired_slots;
+
+        //high-water mark of slots taken from the shared free lists:
+        //live and retired slots plus the per-thread caches
+        std::size_t peak_slots;
+
+        //code memory mapped for slots and pool blocks
+        std::size_t mapped_bytes;
+
+        std::size_t constructed;
+        std::size_t destroyed;
+
+        //functors that did not fit their code slot
+        std::size_t functor_heap_bytes;
+
+        //code emitted since the start
+        std::size_t code_bytes;
+    };
+
+    //counters written only by their own thread, read by collect_statistics()
+    struct thread_counters
+    {
+        std::atomic<std::size_t> allocated{0};
+        std::atomic<std::size_t> deallocated{0};
+        std::atomic<std::size_t> retired{0};
+        std::atomic<std::size_t> reclaimed{0};
+        std::atomic<std::size_t> constructed{0};
+        std::atomic<std::size_t> destroyed{0};
+        std::atomic<std::size_t> heap_allocated{0};
+        std::atomic<std::size_t> heap_freed{0};
+        std::atomic<std::size_t> code_bytes{0};
+
+        std::atomic<bool> taken{true};
+        thread_counters* next = nullptr;
+
+        //a plain load and store, the owner is the only writer
+        static void add(std::atomic<std::size_t>& counter, std::size_t value) noexcept
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        static thread_counters& local() noexcept
+        {
+            thread_local thread_counters* instance = nullptr;
+            if (!instance)
+                instance = attach();
+
+            return *instance;
+        }
+
+    private:
+        static thread_counters* attach() noexcept;
+    };
+
+    statistics collect_statistics();
+
+    std::ostream& operator<<(std::ostream& out, statistics const& stats);
+} //namespace utils
+
+#endif // STATISTICS_H
@@ -1,7 +1,28 @@
 #include "trampoline.h"
+#include "trampoline_pool.h"
 
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <numeric>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
 
 int sub(int a)
 {
@@ -323,13 +344,1167 @@ void hard_test()
         auto p = tr.get();
 
         assert(p(1, 2, 3, 4, 5, 6, 7, 8.8f) == 8);
-    }  
+    }
+
+    {
+        long k = 1000;
+        trampoline<long (long, long, long, long, long, long)> tr =
+                [k](long a, long b, long c, long d, long e, long f)
+        {
+            return k + a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f;
+        };
+
+        assert(tr.get()(1, 2, 3, 4, 5, 6) == 1000 + 1 + 4 + 9 + 16 + 25 + 36);
+    }
+
+    {
+        long k = 1000;
+        trampoline<long (long, long, long, long, long, long, long, long, long, long)> tr =
+                [k](long a, long b, long c, long d, long e, long f, long g, long h, long i, long j)
+        {
+            return k + a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j;
+        };
+
+        assert(tr.get()(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 1000 + 385);
+        assert(tr(1, 2, 3, 4, 5, 6, 7, 8, 9, 10) == 1000 + 385);
+    }
+
+    {
+        //the ninth and tenth doubles are on the stack in front of the sixth integer
+        double k = 0.5;
+        trampoline<double (double, double, double, double, double, double, double, double, double, double,
+                           int, int, int, int, int, int, int)> tr =
+                [k](double a, double b, double c, double d, double e, double f, double g, double h, double i, double j,
+                    int l, int m, int n, int o, int q, int r, int t)
+        {
+            return k + a + b + c + d + e + f + g + h + 100 * i + 1000 * j
+                   + l + 2 * m + 3 * n + 4 * o + 5 * q + 10000 * r + 100000 * t;
+        };
+
+        double const r = tr.get()(1, 1, 1, 1, 1, 1, 1, 1, 2, 3, 1, 1, 1, 1, 1, 4, 5);
+        assert(r == 0.5 + 8 + 200 + 3000 + 15 + 40000 + 500000);
+    }
+}
+
+struct counted
+{
+    static int alive;
+    int value;
+
+    explicit counted(int value) noexcept
+        : value{value}
+    {
+        ++alive;
+    }
+
+    counted(counted const& that) noexcept
+        : value{that.value}
+    {
+        ++alive;
+    }
+
+    ~counted()
+    {
+        --alive;
+    }
+
+    int operator()(int a) const
+    {
+        return a + value;
+    }
+};
+
+int counted::alive = 0;
+
+enum class color
+{
+    red = 1,
+    green = 2
+};
+
+struct point
+{
+    double x;
+    double y;
+};
+
+struct pair
+{
+    long first;
+    long second;
+};
+
+struct mixed
+{
+    long integer;
+    double floating;
+};
+
+struct big
+{
+    long values[4];
+};
+
+//a user-provided assignment keeps copies trivial for calls, so it still goes in registers
+struct assigned
+{
+    double x;
+    double y;
+
+    assigned& operator=(assigned const& that)
+    {
+        x = that.x;
+        y = that.y;
+        return *this;
+    }
+};
+
+struct big_assigned
+{
+    long values[3];
+
+    big_assigned& operator=(big_assigned const& that)
+    {
+        std::copy(that.values, that.values + 3, values);
+        return *this;
+    }
+};
+
+namespace utils
+{
+    template <>
+    struct abi_class<point> : eightbytes<eightbyte_class::sse, eightbyte_class::sse>
+    {};
+
+    template <>
+    struct abi_class<pair> : eightbytes<eightbyte_class::integer, eightbyte_class::integer>
+    {};
+
+    template <>
+    struct abi_class<mixed> : eightbytes<eightbyte_class::integer, eightbyte_class::sse>
+    {};
+
+    template <>
+    struct abi_class<assigned> : eightbytes<eightbyte_class::sse, eightbyte_class::sse>
+    {};
+
+    template <>
+    struct abi_class<std::pair<long, long>> : eightbytes<eightbyte_class::integer, eightbyte_class::integer>
+    {};
+} //namespace utils
+
+void abi_test()
+{
+    long k = 1000;
+
+    {
+        trampoline<long ()> tr = [k] { return k; };
+        assert(tr.get()() == 1000);
+    }
+
+    {
+        //pointers, enums and references are integers, the last one spills to the stack
+        int x = 7;
+        long y = 11;
+        trampoline<long (int*, color, char, short, long*, unsigned, int&)> tr =
+                [k](int* a, color b, char c, short d, long* e, unsigned f, int& g)
+        {
+            return k + *a + 10 * static_cast<long>(b) + 100 * c + 1000 * d + *e + 10000 * f + 100000 * g;
+        };
+
+        assert(tr.get()(&x, color::green, 3, 4, &y, 5, x) == 1000 + 7 + 20 + 300 + 4000 + 11 + 50000 + 700000);
+    }
+
+    {
+        double d = 0.25;
+        trampoline<double (double&, double const&, float, int, double, double, double, double, double, double, double, int)> tr =
+                [d](double& a, double const& b, float c, int i, double e, double f, double g, double h,
+                    double l, double m, double n, int j)
+        {
+            return d + a + 2 * b + 3 * c + 4 * i + 5 * e + 6 * f + 7 * g + 8 * h + 9 * l + 10 * m + 11 * n + 12 * j;
+        };
+
+        double a = 1, b = 1;
+        assert(tr.get()(a, b, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1) == 0.25 + 78);
+    }
+
+    {
+        long double d = 0.5;
+        trampoline<long double (long double, int, long double, double)> tr =
+                [d](long double a, int b, long double c, double e) { return d + a + 2 * b + 4 * c + 8 * e; };
+
+        assert(tr.get()(1, 1, 1, 1) == 0.5 + 15);
+    }
+
+    {
+        //__int128 takes two registers and goes to the stack when only one is left
+        trampoline<__int128 (int, int, int, int, __int128, int)> tr =
+                [k](int a, int b, int c, int d, __int128 e, int f) { return k + a + b + c + d + e + f; };
+
+        __int128 const wide = static_cast<__int128>(1) << 100;
+        assert(tr.get()(1, 2, 3, 4, wide, 5) == wide + 1015);
+    }
+
+    {
+        trampoline<double (point, double, point)> tr =
+                [k](point a, double b, point c) { return k + a.x + 2 * a.y + 4 * b + 8 * c.x + 16 * c.y; };
+
+        assert(tr.get()({1, 1}, 1, {1, 1}) == 1031);
+    }
+
+    {
+        //the pair fits the caller's r8 and r9 but not the callee's registers,
+        //so the long after it moves from the caller's stack to r9
+        trampoline<long (int, int, int, int, pair, long)> tr =
+                [k](int a, int b, int c, int d, pair e, long f) { return k + a + b + c + d + 10 * e.first + 100 * e.second + 1000 * f; };
+
+        assert(tr.get()(1, 1, 1, 1, {2, 3}, 4) == 1000 + 4 + 20 + 300 + 4000);
+    }
+
+    {
+        //the mixed structure leaves xmm0 for the stack and the double moves from xmm1 to xmm0
+        trampoline<double (int, int, int, int, int, mixed, double)> tr =
+                [k](int a, int b, int c, int d, int e, mixed f, double g)
+        {
+            return k + a + b + c + d + e + 10 * f.integer + 100 * f.floating + 1000 * g;
+        };
+
+        assert(tr.get()(1, 1, 1, 1, 1, {2, 0.5}, 3) == 1000 + 5 + 20 + 50 + 3000);
+    }
+
+    {
+        trampoline<long (big, int, int, int, int, int, int, big)> tr =
+                [k](big a, int b, int c, int d, int e, int f, int g, big h)
+        {
+            return k + a.values[0] + a.values[3] + b + c + d + e + f + 100 * g + h.values[0] + 10000 * h.values[3];
+        };
+
+        assert(tr.get()({{1, 0, 0, 2}}, 1, 1, 1, 1, 1, 3, {{4, 0, 0, 5}}) == 1000 + 3 + 5 + 300 + 4 + 50000);
+    }
+
+    {
+        //std::pair is not trivially copyable, yet it is passed and returned in registers
+        trampoline<long (std::pair<long, long>, long, long, long, long)> t1 =
+                [k](std::pair<long, long> a, long b, long c, long d, long e) { return k + a.first + 10 * a.second + b + c + d + e; };
+        assert(t1.get()({1, 2}, 1, 1, 1, 1) == 1025);
+
+        trampoline<std::pair<long, long> (long)> t2 = [k](long a) { return std::pair<long, long>{k, a}; };
+        assert(t2.get()(7) == std::make_pair(1000L, 7L));
+
+        trampoline<double (assigned, double, assigned, long double)> t3 =
+                [k](assigned a, double b, assigned c, long double d)
+        {
+            return static_cast<double>(k + a.x + 2 * a.y + 4 * b + 8 * c.x + 16 * c.y + 32 * d);
+        };
+        assert(t3.get()({1, 1}, 1, {1, 1}, 1) == 1063);
+
+        trampoline<long (int, big_assigned, int)> t4 =
+                [k](int a, big_assigned b, int c) { return k + a + 10 * b.values[0] + 100 * b.values[2] + 1000 * c; };
+        assert(t4.get()(1, {{2, 0, 3}}, 4) == 1000 + 1 + 20 + 300 + 4000);
+    }
+
+    {
+        //big results and non-trivial classes come with a hidden pointer
+        trampoline<big (long, long)> t1 = [k](long a, long b) { return big{{k, a, b, a + b}}; };
+        big const r = t1.get()(1, 2);
+        assert(r.values[0] == 1000 && r.values[1] == 1 && r.values[2] == 2 && r.values[3] == 3);
+
+        std::string const prefix = "trampoline ";
+        trampoline<std::string (std::string, int, std::string const&)> t2 =
+                [prefix](std::string a, int b, std::string const& c) { return prefix + a + std::to_string(b) + c; };
+        assert(t2.get()("x", 42, "y") == "trampoline x42y");
+    }
+}
+
+void thunk_test()
+{
+    //templates are built by the compiler
+    using chained = utils::thunk<long, long>;
+    static_assert(chained::chained.size == 33 && chained::chained.func_at == 2
+                  && chained::chained.context_at == 15 && chained::chained.target_at == 25);
+
+    //mov rsi rdi; mov rdi func; mov rax target; jmp rax
+    using shifting = utils::thunk<int, int>;
+    static_assert(shifting::shifting.size == 25 && shifting::shifting.func_at == 5 && shifting::shifting.target_at == 15);
+    static_assert(shifting::shifting.code[0] == '\x48' && shifting::shifting.code[23] == '\xff');
+
+    //trampolines of one type differ only in the patched immediates
+    long k = 1;
+    trampoline<long (long)> a = [k](long x) { return x + k; };
+    trampoline<long (long)> b = [k](long x) { return x - k; };
+
+    auto const& proto = utils::thunk<long, long>::shifting;
+    auto const* code_a = reinterpret_cast<char const*>(a.get());
+    auto const* code_b = reinterpret_cast<char const*>(b.get());
+    for (std::size_t i = 0; i != proto.size; ++i)
+        if ((i < proto.func_at || i >= proto.func_at + 8) && (i < proto.target_at || i >= proto.target_at + 8))
+            assert(code_a[i] == proto.code[i] && code_b[i] == proto.code[i]);
+
+    assert(a(2) == 3 && b(2) == 1);
+}
+
+//counts how often a by-value argument is copied and moved on its way
+struct tracked
+{
+    static int copies;
+    static int moves;
+
+    int value;
+
+    tracked(int value)
+        : value{value}
+    {}
+
+    tracked(tracked const& that)
+        : value{that.value}
+    {
+        ++copies;
+    }
+
+    tracked(tracked&& that) noexcept
+        : value{that.value}
+    {
+        ++moves;
+    }
+};
+
+int tracked::copies = 0;
+int tracked::moves = 0;
+
+int tracked_function(tracked a)
+{
+    return a.value;
+}
+
+void invoke_test()
+{
+    int k = 1;
+    trampoline<int (tracked)> with_functor = [k](tracked a) { return a.value + k; };
+    trampoline<int (tracked)> with_pointer = tracked_function;
+    trampoline<int (tracked)> stateless = [](tracked a) { return a.value; };
+
+    tracked const argument{1};
+
+    //one copy into operator(), one move into the callee
+    for (auto* tr : {&with_functor, &with_pointer, &stateless})
+    {
+        tracked::copies = tracked::moves = 0;
+        int const result = (*tr)(argument);
+
+        assert(result == 1 || result == 2);
+        assert(tracked::copies == 1 && tracked::moves == 1);
+    }
+
+    assert(with_functor.get()(argument) == 2 && with_pointer.get()(argument) == 1);
+
+    trampoline<int (tracked)> empty;
+    assert(!empty && empty == nullptr && empty.get() == nullptr);
+    assert(with_pointer && with_pointer != nullptr && stateless != nullptr);
+}
+
+void static_chain_test()
+{
+    long k = 1000;
+
+    {
+        trampoline<long (long)> tr{utils::static_chain, [k](long a) { return k + a; }};
+        assert(tr(1) == 1001);
+        assert(tr.get()(2) == 1002);
+
+        trampoline<long (long)> moved = std::move(tr);
+        assert(moved.get()(3) == 1003);
+    }
+
+    {
+        trampoline<long (long, long, long, long, long, long, long, long)> tr{utils::static_chain,
+                [k](long a, long b, long c, long d, long e, long f, long g, long h)
+        {
+            return k + a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+        }};
+
+        assert(tr.get()(1, 1, 1, 1, 1, 1, 1, 1) == 1036);
+    }
+
+    {
+        trampoline<double (double, int, float, point, long double)> tr{utils::static_chain,
+                [k](double a, int b, float c, point d, long double e)
+        {
+            return static_cast<double>(k + a + 2 * b + 4 * c + 8 * d.x + 16 * d.y + 32 * e);
+        }};
+
+        assert(tr.get()(1, 1, 1, {1, 1}, 1) == 1063);
+    }
+
+    {
+        std::string const prefix = "chain ";
+        trampoline<std::string (std::string const&, int)> tr{utils::static_chain,
+                [prefix](std::string const& a, int b) { return prefix + a + std::to_string(b); }};
+
+        assert(tr.get()("x", 1) == "chain x1");
+    }
+
+    {
+        trampoline<int (int)> tr{utils::static_chain, [](int a) { return a + 1; }};
+        assert(tr.get()(1) == 2);
+    }
+
+    {
+        //the context is per thread and read before a nested thunk replaces it
+        trampoline<long (long)> inner{utils::static_chain, [k](long a) { return k * a; }};
+        auto inner_ptr = inner.get();
+        trampoline<long (long)> outer{utils::static_chain, [k, inner_ptr](long a) { return inner_ptr(a) + k + a; }};
+        assert(outer.get()(2) == 2000 + 1000 + 2);
+
+        long results[4] = {};
+        std::vector<std::thread> threads;
+        for (long t = 0; t != 4; ++t)
+            threads.emplace_back([&outer, &results, t]
+            {
+                for (long i = 0; i != 10000; ++i)
+                    results[t] += outer.get()(t) - 1000 * (t + 1) - t;
+            });
+
+        for (auto& thread : threads)
+            thread.join();
+        for (long result : results)
+            assert(result == 0);
+    }
+}
+
+void storage_test()
+{
+    {
+        trampoline<int (int)> tr = counted{42};
+        assert(counted::alive == 1);
+        assert(tr(1) == 43);
+        assert(tr.get()(1) == 43);
+
+        trampoline<int (int)> moved = std::move(tr);
+        assert(counted::alive == 1);
+        assert(moved.get()(2) == 44);
+
+        moved = nullptr;
+        assert(counted::alive == 0);
+    }
+
+    {
+        std::array<int, 128> big{};
+        big[127] = 42;
+
+        trampoline<int (int)> tr = [big](int a) { return a + big[127]; };
+        assert(tr(1) == 43);
+        assert(tr.get()(1) == 43);
+    }
+
+    {
+        int calls = 0;
+        trampoline<int (int)> tr = [calls](int a) mutable { return a + ++calls; };
+        assert(tr(1) == 2);
+        assert(tr.get()(1) == 3);
+    }
+
+    {
+        //a functor written by const calls is kept off the cache lines of its thunk
+        struct counting
+        {
+            mutable long calls = 0;
+
+            std::uintptr_t operator()() const
+            {
+                ++calls;
+                return reinterpret_cast<std::uintptr_t>(this);
+            }
+        };
+
+        auto const before = utils::collect_statistics();
+        trampoline<std::uintptr_t ()> tr = counting{};
+        assert(utils::collect_statistics().functor_heap_bytes == before.functor_heap_bytes);
+
+        auto const code = reinterpret_cast<std::uintptr_t>(utils::allocator::get_instance().writable(reinterpret_cast<void*>(tr.get())));
+        std::uintptr_t const data = tr.get()();
+        assert(data / 64 > (code + utils::thunk<std::uintptr_t>::shifting.size - 1) / 64);
+        assert(tr() == data);
+    }
+
+    assert(counted::alive == 0);
+}
+
+//empty, but its construction and destruction can be observed
+struct noisy
+{
+    static int constructed;
+    static int destroyed;
+
+    noisy()
+    {
+        ++constructed;
+    }
+
+    noisy(noisy const&)
+    {
+        ++constructed;
+    }
+
+    ~noisy()
+    {
+        ++destroyed;
+    }
+
+    int operator()(int a) const
+    {
+        return a + 1;
+    }
+};
+
+int noisy::constructed = 0;
+int noisy::destroyed = 0;
+
+void stateless_test()
+{
+    {
+        auto lambda = [](int a) { return a + 42; };
+        trampoline<int (int)> tr = lambda;
+
+        int (*expected)(int) = lambda;
+        assert(tr.get() == expected);
+        assert(tr(1) == 43);
+    }
+
+    {
+        trampoline<int (int, int, int, int, int)> t1 = func_obj{};
+        trampoline<int (int, int, int, int, int)> t2 = func_obj{};
+
+        assert(t1);
+        assert(t1.get() == t2.get());
+        assert(t1(1, 2, 3, 4, 5) == 42);
+        assert(t1.get()(1, 2, 3, 4, 5) == 42);
+
+        trampoline<int (int, int, int, int, int)> moved = std::move(t1);
+        assert(!t1);
+        assert(moved.get() == t2.get());
+    }
+
+    {
+        //an empty functor with observable construction lives as long as its trampoline
+        {
+            trampoline<int (int)> tr = noisy{};
+            int const constructed = noisy::constructed;
+            int const destroyed = noisy::destroyed;
+            assert(constructed == destroyed + 1);
+
+            for (int i = 0; i != 3; ++i)
+                assert(tr(i) == i + 1 && tr.get()(i) == i + 1);
+            assert(noisy::constructed == constructed && noisy::destroyed == destroyed);
+        }
+
+        assert(noisy::constructed == noisy::destroyed);
+    }
+
+    {
+        //the parameter types differ, so the generic path is taken
+        trampoline<int (int&)> tr = [](int const& a) { return a; };
+        int a = 7;
+        assert(tr.get()(a) == 7);
+    }
+}
+
+struct base_functor
+{
+    int value = 1;
+
+    virtual ~base_functor() = default;
+
+    virtual int operator()(int a, int b) const
+    {
+        return a + b + value;
+    }
+};
+
+struct derived_functor : base_functor
+{
+    int operator()(int a, int b) const override
+    {
+        return a * b + value;
+    }
+};
+
+void dispatch_test()
+{
+    {
+        //exact signature, the thunk enters operator() directly
+        int c = 3;
+        trampoline<int (int, int)> tr = [c](int a, int b) { return a * b + c; };
+        assert(tr.get()(4, 5) == 23);
+        assert(tr(4, 5) == 23);
+    }
+
+    {
+        //conversions between parameter types need do_call
+        int c = 3;
+        trampoline<long (int, int)> tr = [c](long a, long b) { return a * b + c; };
+        assert(tr.get()(4, 5) == 23);
+    }
+
+    {
+        double c = 0.5;
+        trampoline<double (double, int)> tr = [c](auto a, auto b) { return a * b + c; };
+        assert(tr.get()(1.5, 2) == 3.5);
+    }
+
+    {
+        trampoline<int (int, int)> tr = derived_functor{};
+        assert(tr.get()(4, 5) == 21);
+    }
+
+    {
+        struct overloaded
+        {
+            int value;
+
+            int operator()(int a) const
+            {
+                return a + value;
+            }
+
+            double operator()(double a) const
+            {
+                return a * value;
+            }
+        };
+
+        trampoline<int (int)> t1 = overloaded{2};
+        trampoline<double (double)> t2 = overloaded{2};
+        assert(t1.get()(5) == 7);
+        assert(t2.get()(5) == 10);
+    }
+}
+
+void allocator_test()
+{
+    auto& allocator = utils::allocator::get_instance();
+
+    for (std::size_t size : {1, 24, 32, 33, 64, 100, 128, 200, 256, 257, 512})
+    {
+        std::size_t alignment = 32;
+        while (alignment < size)
+            alignment *= 2;
+
+        void* a = allocator.allocate(size);
+        void* b = allocator.allocate(size);
+
+        assert(a != b);
+        assert(reinterpret_cast<std::uintptr_t>(a) % alignment == 0);
+        assert(reinterpret_cast<std::uintptr_t>(b) % alignment == 0);
+
+        allocator.deallocate(a);
+        allocator.deallocate(b);
+    }
+
+    bool thrown = false;
+    try
+    {
+        allocator.allocate(utils::allocator::max_size + 1);
+    }
+    catch (std::bad_alloc const&)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+
+    int one = 1, two = 2;
+    trampoline<int (int)> t1 = [one](int a) { return a + one; };
+    trampoline<int (int)> t2 = [two](int a) { return a + two; };
+
+    assert(reinterpret_cast<std::uintptr_t>(t1.get()) % 32 == 0);
+    assert(t1.get()(1) == 2 && t2.get()(1) == 3);
+}
+
+void statistics_test()
+{
+    auto const before = utils::collect_statistics();
+
+    {
+        int k = 1;
+        std::array<char, 1024> big{};
+        big[0] = 2;
+
+        trampoline<int (int)> small = [k](int a) { return a + k; };
+        trampoline<int (int)> heap = [big](int a) { return a + big[0]; };
+        trampoline<int (int)> stateless = [](int a) { return a; };
+
+        auto const during = utils::collect_statistics();
+        assert(during.live_slots == before.live_slots + 2);
+        assert(during.constructed == before.constructed + 2);
+        assert(during.functor_heap_bytes == before.functor_heap_bytes + sizeof(big));
+        assert(during.code_bytes == before.code_bytes + 50);
+        assert(during.peak_slots >= during.live_slots && during.mapped_bytes != 0);
+        assert(small(1) + heap(1) + stateless(1) == 6);
+    }
+
+    auto const after = utils::collect_statistics();
+    assert(after.live_slots == before.live_slots);
+    assert(after.destroyed == before.destroyed + 2);
+    assert(after.functor_heap_bytes == before.functor_heap_bytes);
+
+    //counter blocks of exited threads are taken over without losing updates
+    std::vector<std::thread> threads;
+    for (int t = 0; t != 4; ++t)
+        threads.emplace_back([]
+        {
+            for (int round = 0; round != 50; ++round)
+            {
+                std::thread([]
+                {
+                    for (int i = 0; i != 10; ++i)
+                    {
+                        trampoline<int (int)> tr = [i](int a) { return a + i; };
+                        assert(tr.get()(1) == i + 1);
+                    }
+                }).join();
+            }
+        });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    auto const churned = utils::collect_statistics();
+    assert(churned.constructed == after.constructed + 2000 && churned.destroyed == after.destroyed + 2000);
+    assert(churned.live_slots == after.live_slots);
+
+    std::ostringstream text;
+    text << after;
+    assert(text.str().find("live slots: " + std::to_string(after.live_slots) + "\n") != std::string::npos);
+}
+
+void pool_test()
+{
+    {
+        struct callback
+        {
+            int id;
+
+            int operator()(int a) const
+            {
+                return a * 1000 + id;
+            }
+        };
+
+        std::vector<callback> callbacks;
+        for (int i = 0; i != 10000; ++i)
+            callbacks.push_back({i});
+
+        trampoline_pool<int (int), callback> pool{callbacks.begin(), callbacks.end()};
+        assert(pool.size() == 10000 && pool.capacity() == 10000);
+
+        //single pass ranges can not be measured up front
+        using pool_t = trampoline_pool<int (int), callback>;
+        static_assert(!std::is_constructible<pool_t, std::istream_iterator<int>, std::istream_iterator<int>>::value);
+        static_assert(!std::is_constructible<pool_t, int, int>::value);
+
+        for (int i = 0; i != 10000; ++i)
+            assert(pool[static_cast<std::size_t>(i)](7) == 7000 + i);
+    }
+
+    {
+        //mutable and owning functors, destroyed with the pool
+        auto owned = std::make_shared<int>(0);
+        auto counter = [owned, n = 0](int a) mutable { return a + ++n; };
+
+        {
+            trampoline_pool<int (int), decltype(counter)> pool{2};
+            auto first = pool.push_back(counter);
+            auto second = pool.push_back(counter);
+
+            assert(first(10) == 11 && first(10) == 12 && second(10) == 11);
+            assert(owned.use_count() == 4);
+
+            bool thrown = false;
+            try
+            {
+                pool.push_back(counter);
+            }
+            catch (std::bad_alloc const&)
+            {
+                thrown = true;
+            }
+            assert(thrown && pool.size() == 2);
+
+            trampoline_pool<int (int), decltype(counter)> moved = std::move(pool);
+            assert(moved.size() == 2 && pool.size() == 0 && moved[1](0) == 2);
+        }
+
+        assert(owned.use_count() == 2);
+    }
+
+    {
+        //released blocks are reused
+        using seven_t = long (long, long, long, long, long, long, long);
+        auto seven = [k = 3L](long a, long b, long c, long d, long e, long f, long g)
+        {
+            return k + a + b + c + d + e + f + g;
+        };
+
+        void* first;
+        {
+            trampoline_pool<seven_t, decltype(seven)> pool{100};
+            first = reinterpret_cast<void*>(pool.push_back(seven));
+            assert(pool[0](1, 2, 3, 4, 5, 6, 7) == 31);
+        }
+
+        trampoline_pool<int (int), decltype(seven)> empty{0};
+        assert(empty.size() == 0);
+
+        trampoline_pool<seven_t, decltype(seven)> pool{100};
+        assert(reinterpret_cast<void*>(pool.push_back(seven)) == first);
+    }
+}
+
+void write_xor_execute_test()
+{
+    int b = 42;
+    trampoline<int (int)> tr = [b](int a) { return a + b; };
+    auto address = reinterpret_cast<std::uintptr_t>(tr.get());
+
+    std::ifstream maps("/proc/self/maps");
+    bool found = false;
+
+    for (std::string line; std::getline(maps, line);)
+    {
+        std::istringstream in(line);
+        std::uintptr_t begin, end;
+        char dash;
+        std::string permissions;
+
+        in >> std::hex >> begin >> dash >> end >> permissions;
+        if (address < begin || address >= end)
+            continue;
+
+        found = true;
+
+        //the RWX fallback is only taken when memfd is unavailable
+        if (line.find("memfd:trampoline") != std::string::npos)
+            assert(permissions.compare(0, 3, "r-x") == 0);
+    }
+
+    assert(found);
+    assert(tr.get()(5) == 5 + 42);
+}
+
+void fork_test()
+{
+    int const one = 1;
+    trampoline<int (int)> tr = [one](int x) { return x + one; };
+    auto saved = tr.get();
+
+    pid_t const child = ::fork();
+    assert(child != -1);
+
+    if (child == 0)
+    {
+        //the freed slot is taken again, in the child's copy of the code only
+        tr = nullptr;
+        int const hundred = 100;
+        trampoline<int (int)> other = [hundred](int x) { return x * hundred; };
+        ::_exit(other.get()(10) == 1000 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status = 0;
+    assert(::waitpid(child, &status, 0) == child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    assert(saved(10) == 11 && tr.get()(10) == 11);
+
+    //a parent thread that is online at fork() does not hold back the child's grace periods
+    auto& allocator = utils::allocator::get_instance();
+    std::atomic<int> step{0};
+    std::thread reader([&allocator, &step]
+    {
+        allocator.online();
+        step = 1;
+        while (step.load() != 2)
+            std::this_thread::yield();
+        allocator.offline();
+    });
+
+    while (step.load() != 1)
+        std::this_thread::yield();
+
+    int const alive = counted::alive;
+    pid_t const online_child = ::fork();
+    assert(online_child != -1);
+
+    if (online_child == 0)
+    {
+        auto const before = utils::collect_statistics();
+        for (int i = 0; i != 1000; ++i)
+        {
+            trampoline<int (int)> counting = counted{i};
+            if (counting.get()(1) != i + 1)
+                ::_exit(EXIT_FAILURE);
+        }
+
+        //a thread of the child leaves its caches behind on exit
+        std::thread([] { trampoline<int (int)> counting = counted{1}; }).join();
+
+        bool const reclaimed = counted::alive == alive
+                               && utils::collect_statistics().retired_slots == before.retired_slots;
+        ::_exit(reclaimed ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    assert(::waitpid(online_child, &status, 0) == online_child);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+
+    step = 2;
+    reader.join();
+}
+
+void concurrent_test()
+{
+    std::size_t const threads_count = 8;
+    std::size_t const rounds = 200;
+    std::size_t const batch = 100;
+
+    //every thread destroys the trampolines made by its neighbour,
+    //so slots travel between per-thread caches through the global list
+    std::mutex mutex;
+    std::vector<std::vector<trampoline<int (int)>>> handoff;
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t != threads_count; ++t)
+    {
+        threads.emplace_back([&, t]
+        {
+            for (std::size_t r = 0; r != rounds; ++r)
+            {
+                std::vector<trampoline<int (int)>> mine;
+                for (std::size_t i = 0; i != batch; ++i)
+                {
+                    int const tag = static_cast<int>(t * batch + i);
+                    mine.emplace_back([tag](int a) { return a + tag; });
+                }
+
+                for (std::size_t i = 0; i != batch; ++i)
+                    assert(mine[i].get()(1) == static_cast<int>(t * batch + i) + 1);
+
+                std::vector<trampoline<int (int)>> theirs;
+                {
+                    std::lock_guard<std::mutex> lock{mutex};
+                    handoff.push_back(std::move(mine));
+
+                    if (handoff.size() > 1)
+                    {
+                        theirs = std::move(handoff.front());
+                        handoff.erase(handoff.begin());
+                    }
+                }
+
+                for (auto& tr : theirs)
+                    assert(tr.get()(0) == tr(0));
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void grace_period_test()
+{
+    auto& allocator = utils::allocator::get_instance();
+    std::atomic<int> step{0};
+
+    auto wait_for = [&step](int value)
+    {
+        while (step.load() != value)
+            std::this_thread::yield();
+    };
+
+    //a reader that keeps pointers until told to report a quiescent state
+    std::thread reader([&]
+    {
+        allocator.online();
+        step = 1;
+
+        wait_for(2);
+        allocator.quiescent();
+        step = 3;
+
+        wait_for(4);
+        allocator.offline();
+        step = 5;
+    });
+
+    wait_for(1);
+
+    std::size_t const count = 64;
+    auto make = [](std::vector<trampoline<int (int)>>& out, std::size_t n)
+    {
+        for (std::size_t i = 0; i != n; ++i)
+        {
+            int const tag = static_cast<int>(i);
+            out.emplace_back([tag](int a) { return a + tag; });
+        }
+    };
+
+    std::vector<trampoline<int (int)>> old;
+    make(old, count);
+
+    std::vector<char const*> retired;
+    std::vector<std::string> code;
+    for (auto& tr : old)
+    {
+        retired.push_back(reinterpret_cast<char const*>(tr.get()));
+        code.emplace_back(retired.back(), 25);
+    }
+    old.clear();
+
+    //retired slots are neither reused nor overwritten during the grace period
+    std::vector<trampoline<int (int)>> fresh;
+    make(fresh, count);
+    for (auto& tr : fresh)
+        assert(std::find(retired.begin(), retired.end(), reinterpret_cast<char const*>(tr.get())) == retired.end());
+    for (std::size_t i = 0; i != count; ++i)
+        assert(std::string(retired[i], 25) == code[i]);
+
+    //functors are destroyed, and pool blocks reused, only after the grace period too
+    int (*kept_slot)(int);
+    int (*kept_block)(int);
+    void* retired_block;
+    {
+        trampoline<int (int)> in_slot = counted{5};
+        trampoline<int (int)> on_heap = [big = std::array<long, 128>{{7}}](int a) { return a + static_cast<int>(big[0]); };
+        kept_slot = in_slot.get();
+
+        trampoline_pool<int (int), counted> pool{4};
+        kept_block = pool.push_back(counted{6});
+        retired_block = reinterpret_cast<void*>(kept_block);
+        assert(counted::alive == 2);
+
+        fresh.emplace_back(std::move(on_heap));
+    }
+    fresh.pop_back();
+
+    assert(counted::alive == 2);
+    assert(kept_slot(1) == 6 && kept_block(1) == 7);
+    {
+        trampoline_pool<int (int), counted> pool{4};
+        assert(reinterpret_cast<void*>(pool.push_back(counted{1})) != retired_block);
+    }
+    assert(counted::alive == 3 && kept_block(2) == 8);
+
+    step = 2;
+    wait_for(3);
+
+    //the next sealed batch finds the grace period over
+    fresh.clear();
+    make(fresh, 2 * count);
+
+    std::size_t reused = 0;
+    for (auto& tr : fresh)
+        reused += std::find(retired.begin(), retired.end(), reinterpret_cast<char const*>(tr.get())) != retired.end();
+    assert(reused != 0);
+
+    step = 4;
+    wait_for(5);
+    reader.join();
+
+    //without online readers slots are reused at once
+    void* last = reinterpret_cast<void*>(fresh.back().get());
+    fresh.pop_back();
+    int const tag = 1;
+    trampoline<int (int)> again = [tag](int a) { return a + tag; };
+    assert(reinterpret_cast<void*>(again.get()) == last);
+
+    trampoline_pool<int (int), counted> pool{4};
+    assert(counted::alive == 0);
+}
+
+extern "C"
+{
+    struct jit_code_entry
+    {
+        jit_code_entry* next_entry;
+        jit_code_entry* prev_entry;
+        char const* symfile_addr;
+        std::uint64_t symfile_size;
+    };
+
+    struct jit_descriptor
+    {
+        std::uint32_t version;
+        std::uint32_t action_flag;
+        jit_code_entry* relevant_entry;
+        jit_code_entry* first_entry;
+    };
+
+    extern jit_descriptor __jit_debug_descriptor;
+}
+
+//enables the symbols for the rest of the process, so it runs last
+void jit_symbols_test()
+{
+    auto& symbols = utils::jit_symbols::get_instance();
+    symbols.enable(utils::jit_symbols::perf_map | utils::jit_symbols::gdb_jit);
+
+    auto registered = []
+    {
+        std::vector<std::string> images;
+        for (auto* e = __jit_debug_descriptor.first_entry; e; e = e->next_entry)
+            images.emplace_back(e->symfile_addr, e->symfile_size);
+        return images;
+    };
+
+    std::size_t const before = registered().size();
+
+    {
+        long k = 1;
+        trampoline<long (long, long, long, long, long, long, long, long)> tr =
+                [k](long a, long, long, long, long, long, long, long h) { return a + h + k; };
+        assert(tr.get()(1, 0, 0, 0, 0, 0, 0, 2) == 4);
+
+        auto images = registered();
+        assert(images.size() == before + 1);
+        assert(images.front().compare(0, 4, "\x7f" "ELF") == 0);
+        assert(images.front().find("trampoline<long (long, long, long, long, long, long, long, long)> for "
+                                   "jit_symbols_test()::{lambda(long, long, long, long, long, long, long, long)")
+               != std::string::npos);
+
+        std::ostringstream address;
+        address << std::hex << reinterpret_cast<std::uintptr_t>(tr.get()) << ' ';
+
+        std::string const path = "/tmp/perf-" + std::to_string(::getpid()) + ".map";
+        std::ifstream map{path};
+        std::string line;
+        bool found = false;
+        while (std::getline(map, line))
+            found |= line.compare(0, address.str().size(), address.str()) == 0
+                     && line.find("trampoline<long (long, long, long, long, long, long, long, long)>") != std::string::npos;
+        assert(found);
+
+        std::remove(path.c_str());
+    }
+
+    assert(registered().size() == before);
 }
 
 int main()
 {
     simple_test();
     hard_test();
+    abi_test();
+    thunk_test();
+    invoke_test();
+    static_chain_test();
+    storage_test();
+    stateless_test();
+    dispatch_test();
+    allocator_test();
+    statistics_test();
+    pool_test();
+    write_xor_execute_test();
+    fork_test();
+    concurrent_test();
+    grace_period_test();
+    jit_symbols_test();
 
     return EXIT_SUCCESS;
 }
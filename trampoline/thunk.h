@@ -0,0 +1,400 @@
+#ifndef THUNK_H
+#define THUNK_H
+
+#include <array>
+#include <string_view>
+#include <cstdint>
+#include <cstddef>
+
+#include "arguments.h"
+
+namespace utils
+{
+    //x86-64 encoder for the handful of instructions thunks are made of,
+    //registers are hardware numbers: rax = 0, rcx = 1, ..., r15 = 15
+    struct handler_t
+    {
+        char* ptr;
+
+        //System V argument registers in order: rdi, rsi, rdx, rcx, r8, r9
+        constexpr static std::array<unsigned char, 6> const integer_registers = {{7, 6, 2, 1, 8, 9}};
+
+        constexpr static unsigned char const rax = 0;
+        constexpr static unsigned char const r11 = 11;
+        constexpr static unsigned char const xmm15 = 15;
+
+        constexpr handler_t(char* ptr)
+            : ptr(ptr)
+        {}
+
+        constexpr void write(std::string_view cmd)
+        {
+            for (auto i = cmd.begin(); i != cmd.end(); ++i)
+                *(ptr++) = *i;
+        }
+
+        constexpr void byte(unsigned value)
+        {
+            *(ptr++) = static_cast<char>(value);
+        }
+
+        constexpr void imm32(int32_t value)
+        {
+            for (unsigned i = 0; i != 4; ++i)
+                byte(static_cast<std::uint32_t>(value) >> (8 * i) & 0xff);
+        }
+
+        constexpr void imm64(std::uint64_t value)
+        {
+            for (unsigned i = 0; i != 8; ++i)
+                byte(value >> (8 * i) & 0xff);
+        }
+
+        //ModRM and SIB of an [rsp + disp] operand, disp8 when it fits
+        constexpr void rsp_operand(unsigned reg, int32_t disp)
+        {
+            if (disp >= -128 && disp < 128)
+            {
+                byte(0x44 | (reg & 7) << 3);
+                byte(0x24);
+                byte(static_cast<unsigned>(disp) & 0xff);
+            }
+            else
+            {
+                byte(0x84 | (reg & 7) << 3);
+                byte(0x24);
+                imm32(disp);
+            }
+        }
+
+        //mov dst src
+        constexpr void mov(unsigned dst, unsigned src)
+        {
+            byte(0x48 | (src >> 3) << 2 | dst >> 3);
+            byte(0x89);
+            byte(0xc0 | (src & 7) << 3 | (dst & 7));
+        }
+
+        //mov [rsp + disp] src
+        constexpr void store(int32_t disp, unsigned src)
+        {
+            byte(0x48 | (src >> 3) << 2);
+            byte(0x89);
+            rsp_operand(src, disp);
+        }
+
+        //mov dst [rsp + disp]
+        constexpr void load(unsigned dst, int32_t disp)
+        {
+            byte(0x48 | (dst >> 3) << 2);
+            byte(0x8b);
+            rsp_operand(dst, disp);
+        }
+
+        //movaps xmm_dst xmm_src
+        constexpr void mov_sse(unsigned dst, unsigned src)
+        {
+            if (dst >= 8 || src >= 8)
+                byte(0x40 | (dst >> 3) << 2 | src >> 3);
+            byte(0x0f);
+            byte(0x28);
+            byte(0xc0 | (dst & 7) << 3 | (src & 7));
+        }
+
+        //movsd [rsp + disp] xmm_src
+        constexpr void store_sse(int32_t disp, unsigned src)
+        {
+            byte(0xf2);
+            if (src >= 8)
+                byte(0x44);
+            byte(0x0f);
+            byte(0x11);
+            rsp_operand(src, disp);
+        }
+
+        //movsd xmm_dst [rsp + disp]
+        constexpr void load_sse(unsigned dst, int32_t disp)
+        {
+            byte(0xf2);
+            if (dst >= 8)
+                byte(0x44);
+            byte(0x0f);
+            byte(0x10);
+            rsp_operand(dst, disp);
+        }
+
+        //mov dst imm64
+        constexpr void mov_imm(unsigned dst, std::uint64_t value)
+        {
+            byte(0x48 | dst >> 3);
+            byte(0xb8 | (dst & 7));
+            imm64(value);
+        }
+
+        //add/sub rsp imm
+        constexpr void add_rsp(int32_t value)
+        {
+            byte(0x48);
+            if (value >= -128 && value < 128)
+            {
+                byte(0x83);
+                byte(0xc4);
+                byte(static_cast<unsigned>(value) & 0xff);
+            }
+            else
+            {
+                byte(0x81);
+                byte(0xc4);
+                imm32(value);
+            }
+        }
+
+        constexpr void sub_rsp(int32_t value)
+        {
+            byte(0x48);
+            if (value >= -128 && value < 128)
+            {
+                byte(0x83);
+                byte(0xec);
+                byte(static_cast<unsigned>(value) & 0xff);
+            }
+            else
+            {
+                byte(0x81);
+                byte(0xec);
+                imm32(value);
+            }
+        }
+    };
+
+    //thunk code with zero immediates, built once per signature at compile time:
+    //a trampoline copies it and patches the functor pointer and the target
+    template <std::size_t N>
+    struct thunk_template
+    {
+        std::array<char, N> code;
+        std::size_t size;
+        std::size_t func_at;
+        std::size_t target_at;
+
+        //32-bit fs offset of chain_context, static chain thunks only
+        std::size_t context_at;
+
+        //the call path keeps a frame of frame_size bytes
+        //from the end of sub rsp up to the end of add rsp
+        std::size_t frame_size;
+        std::size_t frame_begin;
+        std::size_t frame_end;
+    };
+
+    //functor of the static chain thunk that runs on this thread: the thunk stores it
+    //right before the jump, the entry reads it before anything else. Initial-exec TLS
+    //lies at a fixed offset from fs in every thread, so the offset is patched like func.
+    //A signal handler that enters another static chain thunk in between overwrites it.
+    inline thread_local void* chain_context __attribute__((tls_model("initial-exec"))) = nullptr;
+
+    inline std::int32_t chain_context_offset() noexcept
+    {
+        char* thread_pointer;
+        asm ("mov %%fs:0, %0" : "=r"(thread_pointer));
+
+        return static_cast<std::int32_t>(reinterpret_cast<char*>(&chain_context) - thread_pointer);
+    }
+
+    template <typename R, typename ... Args>
+    struct thunk
+    {
+        using abi = signature_abi<R, Args ...>;
+
+        //worst case: every eightbyte is copied between stacks by a disp32 load and store
+        constexpr static std::size_t const max_code_size = 40 + 20 * abi::eightbytes;
+
+        using template_t = thunk_template<max_code_size>;
+
+        //inserts the functor pointer in front of Args and enters the target:
+        //registers and stack slots move from the caller's layout to the callee's one,
+        //a tail jump is taken when the stack arguments stay in place
+        constexpr static template_t assemble()
+        {
+            template_t result{};
+            char* const code = result.code.data();
+            handler_t handler{code};
+
+            auto const& from = abi::caller;
+            auto const& to = abi::callee;
+            std::size_t const count = abi::eightbytes;
+
+            bool same_stack = from.stack_size == to.stack_size;
+            for (std::size_t k = 0; k != count; ++k)
+                if ((from.at[k].kind == location_kind::stack) != (to.at[k].kind == location_kind::stack)
+                        || (from.at[k].kind == location_kind::stack && from.at[k].index != to.at[k].index))
+                    same_stack = false;
+
+            //the new frame keeps rsp 16 byte aligned at the call
+            int32_t const frame_size = same_stack ? 0 : static_cast<int32_t>(((to.stack_size / 8) | 1) * 8);
+            auto const incoming = [frame_size](std::size_t offset)
+            {
+                return frame_size + 8 + static_cast<int32_t>(offset);
+            };
+
+            auto const hardware = [](location const& at)
+            {
+                return at.kind == location_kind::integer_register ? handler_t::integer_registers[at.index]
+                                                                  : static_cast<unsigned char>(at.index);
+            };
+
+            if (!same_stack)
+            {
+                handler.sub_rsp(frame_size);
+
+                result.frame_size = static_cast<std::size_t>(frame_size);
+                result.frame_begin = static_cast<std::size_t>(handler.ptr - code);
+            }
+
+            //fill the new frame while every source is still intact
+            for (std::size_t k = 0; !same_stack && k != count; ++k)
+            {
+                if (to.at[k].kind != location_kind::stack)
+                    continue;
+
+                int32_t const disp = static_cast<int32_t>(to.at[k].index);
+
+                if (from.at[k].kind == location_kind::integer_register)
+                    handler.store(disp, hardware(from.at[k]));
+                else if (from.at[k].kind == location_kind::sse_register)
+                    handler.store_sse(disp, hardware(from.at[k]));
+                else
+                {
+                    handler.load(handler_t::rax, incoming(from.at[k].index));
+                    handler.store(disp, handler_t::rax);
+                }
+            }
+
+            //register to register moves form a parallel move,
+            //a cycle is broken through r11 or xmm15
+            struct move_t
+            {
+                bool sse;
+                unsigned char src;
+                unsigned char dst;
+                bool done;
+            } moves[count + 1] = {};
+            std::size_t moves_count = 0;
+
+            for (std::size_t k = 0; k != count; ++k)
+                if (from.at[k].kind != location_kind::stack && to.at[k].kind != location_kind::stack
+                        && hardware(from.at[k]) != hardware(to.at[k]))
+                    moves[moves_count++] = {from.at[k].kind == location_kind::sse_register,
+                                            hardware(from.at[k]), hardware(to.at[k]), false};
+
+            for (std::size_t left = moves_count; left != 0;)
+            {
+                bool progress = false;
+
+                for (std::size_t i = 0; i != moves_count; ++i)
+                {
+                    if (moves[i].done)
+                        continue;
+
+                    bool blocked = false;
+                    for (std::size_t j = 0; j != moves_count; ++j)
+                        if (!moves[j].done && j != i && moves[j].sse == moves[i].sse && moves[j].src == moves[i].dst)
+                            blocked = true;
+
+                    if (blocked)
+                        continue;
+
+                    if (moves[i].sse)
+                        handler.mov_sse(moves[i].dst, moves[i].src);
+                    else
+                        handler.mov(moves[i].dst, moves[i].src);
+
+                    moves[i].done = true;
+                    progress = true;
+                    --left;
+                }
+
+                if (progress)
+                    continue;
+
+                for (std::size_t i = 0; i != moves_count; ++i)
+                {
+                    if (moves[i].done)
+                        continue;
+
+                    unsigned char const saved = moves[i].dst;
+                    unsigned char const scratch = moves[i].sse ? handler_t::xmm15 : handler_t::r11;
+
+                    if (moves[i].sse)
+                        handler.mov_sse(scratch, saved);
+                    else
+                        handler.mov(scratch, saved);
+
+                    for (std::size_t j = 0; j != moves_count; ++j)
+                        if (!moves[j].done && moves[j].sse == moves[i].sse && moves[j].src == saved)
+                            moves[j].src = scratch;
+                    break;
+                }
+            }
+
+            //registers that were passed on the caller's stack
+            for (std::size_t k = 0; k != count; ++k)
+            {
+                if (from.at[k].kind != location_kind::stack || to.at[k].kind == location_kind::stack)
+                    continue;
+
+                if (to.at[k].kind == location_kind::integer_register)
+                    handler.load(hardware(to.at[k]), incoming(from.at[k].index));
+                else
+                    handler.load_sse(hardware(to.at[k]), incoming(from.at[k].index));
+            }
+
+            result.func_at = static_cast<std::size_t>(handler.ptr - code) + 2;
+            handler.mov_imm(handler_t::integer_registers[abi::hidden], 0);              //mov   rdi/rsi func
+            result.target_at = static_cast<std::size_t>(handler.ptr - code) + 2;
+            handler.mov_imm(handler_t::rax, 0);                                         //mov   rax target
+
+            if (same_stack)
+            {
+                handler.write("\xff\xe0");                                              //jmp   rax
+            }
+            else
+            {
+                handler.write("\xff\xd0");                                              //call  rax
+                handler.add_rsp(frame_size);
+                result.frame_end = static_cast<std::size_t>(handler.ptr - code);
+                handler.write("\xc3");                                                  //ret
+            }
+
+
+            result.size = static_cast<std::size_t>(handler.ptr - code);
+            return result;
+        }
+
+        //mov r10 func; mov fs:[context] r10; jmp [rip]; target;
+        //the same 33 bytes for any signature
+        constexpr static template_t assemble_chained()
+        {
+            template_t result{};
+            char* const code = result.code.data();
+            handler_t handler{code};
+
+            result.func_at = 2;
+            handler.mov_imm(10, 0);                                                     //mov   r10 func
+            handler.write("\x64\x4c\x89\x14\x25");                                      //mov   fs:[context] r10
+            result.context_at = static_cast<std::size_t>(handler.ptr - code);
+            handler.imm32(0);
+            handler.write(std::string_view{"\xff\x25\x00\x00\x00\x00", 6});          //jmp   [rip]
+            result.target_at = static_cast<std::size_t>(handler.ptr - code);
+            handler.imm64(0);
+
+            result.size = static_cast<std::size_t>(handler.ptr - code);
+            return result;
+        }
+
+        constexpr static template_t const shifting = assemble();
+        constexpr static template_t const chained = assemble_chained();
+    };
+} //namespace utils
+
+#endif // THUNK_H
@@ -2,50 +2,28 @@
 #define TRAMPOLINE_H
 
 #include <utility>
-#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
 
-#include "arguments.h"
 #include "allocator.h"
+#include "jit_symbols.h"
+#include "statistics.h"
+#include "thunk.h"
 
-namespace
+namespace utils
 {
-    struct handler_t
-    {
-        char* ptr;
-
-        constexpr static std::array<char const*, 5> const shifts = {
-            {"\x48\x89\xfe",
-            "\x48\x89\xf2",
-            "\x48\x89\xd1",
-            "\x49\x89\xc8",
-            "\x4d\x89\xc1"}
-        };
-
-        handler_t(void* ptr)
-            : ptr(static_cast<char*>(ptr))
-        {}
-
-        void write(std::string_view cmd)
-        {
-            for (auto i = cmd.begin(); i != cmd.end(); ++i)
-                *(ptr++) = *i;
-        }
+    //selects thunks that pass the functor in r10, the static chain register,
+    //and leave the arguments where the caller put them
+    struct static_chain_t
+    {};
 
-        void write(std::string_view cmd, void* obj)
-        {
-            write(cmd);
-            *reinterpret_cast<void**>(ptr) = obj;
-            ptr += sizeof(obj);
-        }
-
-        void write(std::string_view cmd, int32_t const imm)
-        {
-            write(cmd);
-            *reinterpret_cast<int32_t*>(ptr) = imm;
-            ptr += sizeof(imm);
-        }
-    };
-} //namespace
+    constexpr static static_chain_t const static_chain{};
+} //namespace utils
 
 template <typename T>
 class trampoline;
@@ -53,26 +31,252 @@ class trampoline;
 template <typename R, typename ... Args>
 class trampoline<R (Args ...)>
 {
-    using caller_t      = R     (*)(void*, Args ...);
+    //what fits two registers is passed on by value, the rest by reference,
+    //so that neither small arguments go to memory nor large ones get copied again
+    template <typename T>
+    using forwarded_t = std::conditional_t<std::is_trivially_copyable<T>::value && sizeof(T) <= 2 * sizeof(void*), T, T&&>;
+
+    using invoker_t     = R     (*)(void*, forwarded_t<Args> ...);
     using deleter_t     = void  (*)(void*);
     using func_ptr_t    = R     (*)(Args ...);
 
+    //operator() always goes through invoker with func, get() always returns fptr:
+    //the functor and its thunk, or a function pointer kept in func as well
     void* func;
     func_ptr_t fptr;
     void* code;
-    caller_t caller;
+    invoker_t invoker;
     deleter_t deleter;
 
+    //entered by thunks, so Args are taken the way the C signature passes them
     template <typename F>
     static R do_call(void* func, Args ... args)
     {
         return (*static_cast<F*>(func))(std::forward<Args>(args) ...);
     }
 
+    //entered by operator()
+    template <typename F>
+    static R do_invoke(void* func, forwarded_t<Args> ... args)
+    {
+        return (*static_cast<F*>(func))(std::forward<Args>(args) ...);
+    }
+
+    template <typename F>
+    static R do_invoke_stateless(void*, forwarded_t<Args> ... args)
+    {
+        return F{}(std::forward<Args>(args) ...);
+    }
+
+    static R do_invoke_pointer(void* func, forwarded_t<Args> ... args)
+    {
+        return reinterpret_cast<func_ptr_t>(func)(std::forward<Args>(args) ...);
+    }
+
     template <typename F>
     static void do_delete(void* func)
     {
         delete static_cast<F*>(func);
+        utils::thread_counters::add(utils::thread_counters::local().heap_freed, sizeof(F));
+    }
+
+    template <typename F>
+    static void do_destroy(void* func)
+    {
+        static_cast<F*>(func)->~F();
+    }
+
+    //small functors live in the code slot from the cache line after the thunk on:
+    //even const calls may store to mutable members, and a store to a line
+    //holding code is taken for self-modifying code
+    constexpr static std::size_t const cache_line = 64;
+
+    template <typename F>
+    constexpr static bool const fits_slot = std::is_nothrow_move_constructible<F>::value
+                                            && alignof(F) <= cache_line;
+
+    template <typename F, typename = void>
+    struct has_exact_call : std::false_type
+    {};
+
+    template <typename F>
+    struct has_exact_call<F, std::void_t<decltype(static_cast<R (F::*)(Args ...) const>(&F::operator()))>>
+        : std::true_type
+    {};
+
+    //the thunk jumps straight into F::operator() when it takes exactly Args:
+    //`this` is passed like the leading void* of do_call, so no extra frame is needed
+    template <typename F>
+    static void* call_target() noexcept
+    {
+        if constexpr (has_exact_call<F>::value)
+        {
+            auto member = static_cast<R (F::*)(Args ...) const>(&F::operator());
+
+            //Itanium ABI member pointer: odd ptr is a virtual call, adj is a this adjustment
+            struct
+            {
+                std::uintptr_t ptr;
+                std::ptrdiff_t adj;
+            } repr;
+
+            static_assert(sizeof(repr) == sizeof(member), "unexpected member pointer layout");
+            std::memcpy(&repr, &member, sizeof(repr));
+
+            if ((repr.ptr & 1) == 0 && repr.adj == 0)
+                return reinterpret_cast<void*>(repr.ptr);
+        }
+
+        return reinterpret_cast<void*>(&do_call<F>);
+    }
+
+    using thunk = utils::thunk<R, Args ...>;
+
+    template <bool Chained>
+    constexpr static auto const& prototype() noexcept
+    {
+        if constexpr (Chained)
+            return thunk::chained;
+        else
+            return thunk::shifting;
+    }
+
+    //entry of static chain thunks: the functor comes through utils::chain_context,
+    //a plain variable, so nothing depends on how the compiler allocates r10
+    template <typename F>
+    static R do_call_chained(Args ... args)
+    {
+        void* func = utils::chain_context;
+        return (*static_cast<F*>(func))(std::forward<Args>(args) ...);
+    }
+
+    //names the thunk for perf and gdb when utils::jit_symbols is enabled,
+    //missing debug information is not worth a failed construction
+    template <typename F, typename Prototype>
+    static void describe(void const* code, Prototype const& proto) noexcept
+    {
+        auto& symbols = utils::jit_symbols::get_instance();
+        if (!symbols.enabled())
+            return;
+
+        try
+        {
+            symbols.add(code, proto.size,
+                        utils::demangle(typeid(trampoline).name()) + " for " + utils::demangle(typeid(F).name()),
+                        {proto.frame_size, proto.frame_begin, proto.frame_end});
+        }
+        catch (...)
+        {}
+    }
+
+    template <typename F>
+    static R do_call_stateless(Args ... args)
+    {
+        return F{}(std::forward<Args>(args) ...);
+    }
+
+    //empty functors that are made anew for every call: only when that can not
+    //be told apart from keeping one, so nothing may run on construction or destruction
+    template <typename F>
+    constexpr static bool const is_rebuilt = std::is_empty<F>::value
+                                             && std::is_trivially_default_constructible<F>::value
+                                             && std::is_trivially_destructible<F>::value;
+
+    //captureless lambdas, plain function pointers and trivial empty functors
+    //need neither storage nor generated code: a static function does
+    template <typename F>
+    constexpr static bool const is_stateless =
+            (std::is_convertible<F, func_ptr_t>::value && (std::is_empty<F>::value || std::is_pointer<F>::value))
+            || is_rebuilt<F>;
+
+    template <typename F>
+    static func_ptr_t stateless_target(F const& func) noexcept
+    {
+        if constexpr (std::is_convertible<F, func_ptr_t>::value)
+            return func;
+        else
+            return do_call_stateless<F>;
+    }
+
+    template <typename F>
+    static invoker_t stateless_invoker() noexcept
+    {
+        if constexpr (is_rebuilt<F>)
+            return do_invoke_stateless<F>;
+        else
+            return do_invoke_pointer;
+    }
+
+    template <typename F, bool Chained>
+    trampoline(F func, std::true_type, std::bool_constant<Chained>) noexcept
+        : func{reinterpret_cast<void*>(stateless_target(func))},
+          fptr{stateless_target(func)},
+          code{},
+          invoker{stateless_invoker<F>()},
+          deleter{}
+    {}
+
+    template <typename F, bool Chained>
+    trampoline(F func, std::false_type, std::bool_constant<Chained>)
+        : func{},
+          fptr{},
+          code{},
+          invoker{do_invoke<F>},
+          deleter{}
+    {
+        //construction is a copy of the prebuilt thunk and two patched immediates
+        constexpr auto const& proto = prototype<Chained>();
+        static_assert(proto.size <= utils::allocator::max_size, "thunk does not fit a code slot");
+
+        constexpr std::size_t const data_at = (proto.size + cache_line - 1) / cache_line * cache_line;
+        constexpr bool const in_slot = fits_slot<F> && data_at + sizeof(F) <= utils::allocator::max_size;
+
+        auto& allocator = utils::allocator::get_instance();
+        code = allocator.allocate(in_slot ? data_at + sizeof(F) : proto.size);
+        auto* slot = static_cast<char*>(allocator.writable(code));
+
+        if constexpr (in_slot)
+        {
+            this->func = new (slot + data_at) F(std::move(func));
+            deleter = do_destroy<F>;
+        }
+        else
+        {
+            try
+            {
+                this->func = new F(std::move(func));
+            }
+            catch (...)
+            {
+                allocator.deallocate(code);
+                throw;
+            }
+            deleter = do_delete<F>;
+        }
+
+        void* target;
+        if constexpr (Chained)
+            target = reinterpret_cast<void*>(&do_call_chained<F>);
+        else
+            target = call_target<F>();
+
+        std::memcpy(slot, proto.code.data(), proto.size);
+        std::memcpy(slot + proto.func_at, &this->func, sizeof(this->func));
+        std::memcpy(slot + proto.target_at, &target, sizeof(target));
+        if constexpr (Chained)
+        {
+            std::int32_t const context = utils::chain_context_offset();
+            std::memcpy(slot + proto.context_at, &context, sizeof(context));
+        }
+
+        auto& counters = utils::thread_counters::local();
+        utils::thread_counters::add(counters.constructed, 1);
+        utils::thread_counters::add(counters.code_bytes, proto.size);
+        if constexpr (!in_slot)
+            utils::thread_counters::add(counters.heap_allocated, sizeof(F));
+
+        fptr = reinterpret_cast<func_ptr_t>(code);
+        describe<F>(code, proto);
     }
 
     void clear() noexcept
@@ -80,106 +284,43 @@ class trampoline<R (Args ...)>
         func    = nullptr;
         fptr    = nullptr;
         code    = nullptr;
-        caller  = nullptr;
+        invoker = nullptr;
         deleter = nullptr;
     }
 
 public:
     trampoline() noexcept
         : func{}, fptr{}, code{},
-          caller{}, deleter{}
+          invoker{}, deleter{}
     {}
 
     trampoline(trampoline&& that) noexcept
         : func{std::move(that.func)},
           fptr{std::move(that.fptr)},
           code{std::move(that.code)},
-          caller{std::move(that.caller)},
+          invoker{std::move(that.invoker)},
           deleter{std::move(that.deleter)}
     {
         that.clear();
     }
 
     trampoline(func_ptr_t fptr) noexcept
-        : func{},
-          fptr{std::move(fptr)},
+        : func{reinterpret_cast<void*>(fptr)},
+          fptr{fptr},
           code{},
-          caller{},
+          invoker{fptr ? do_invoke_pointer : nullptr},
           deleter{}
     {}
 
     template <typename F>
     trampoline(F func)
-        : func{new F(std::move(func))},
-          fptr{},
-          caller{do_call<F>},
-          deleter{do_delete<F>}
-    {   
-        code = utils::allocator::get_instance().allocate();
-        handler_t handler{code};
-
-        size_t const arguments_size = utils::integral_arguments<Args ...>::value;
-
-        //shift all arguments in registers and put given functional object at rdi
-        if (arguments_size < 6)
-        {
-            for (size_t i = arguments_size; i != 0; --i)
-                handler.write(handler_t::shifts[i - 1]);
-
-            handler.write("\x48\xbf", this->func);                              //mov rdi this->func
-            handler.write("\x48\xb8", reinterpret_cast<void*>(&do_call<F>));    //mov rax do_call
-            handler.write("\xff\xe0");                                          //jmp rax
-        }
-        else
-        {
-            //save return address
-            handler.write("\x4c\x8b\x1c\x24");                              //mov   r11 [rsp]
-
-            //shift arguments in registers
-            for (size_t i = 5; i != 0; i--)
-                handler.write(handler_t::shifts[i - 1]);
-
-            int32_t stack_size = (arguments_size - 6 + utils::floating_arguments<Args ...>::value) * 8;
-
-            //prepare stack for function call
-            handler.write("\x48\x89\xe0");                                  //mov   rax rsp
-            handler.write("\x48\x05", stack_size);                          //add   rax stack_size
-            handler.write("\x41\x51");                                      //push  r9
-            handler.write("\x48\x81\xc4", 8);                               //add   rsp 8
-
-            //placing arguments in stack
-            auto* label = handler.ptr;                                      //label for cycling
-
-            handler.write("\x48\x39\xe0");                                  //cmp   rax rsp
-            handler.write("\x74");                                          //je    break
-
-            auto* break_label = handler.ptr;
-
-            ++handler.ptr;
-            handler.write("\x48\x81\xc4", 8);                               //add   rsp 8
-            handler.write("\x4c\x8c\x0c\x24");                              //mov   r9  [rsp]
-            handler.write("\x4c\x89\x4c\x24\xf8");                          //mov   [rsp - 8] r9
-
-            handler.write("\xeb");                                          //jmp   label
-
-            *handler.ptr = static_cast<char>(label - handler.ptr);
-            ++handler.ptr;
-            *break_label = static_cast<char>(handler.ptr - break_label - 1);//break:
-
-            //arguments are shifted, call the function
-            handler.write("\x4c\x89\x1c\x24");                              //mov   [rsp] r11
-            handler.write("\x48\x81\xec", stack_size + 8);                  //sub   rsp on_stack + 8
-            handler.write("\x48\xbf", this->func);                          //mov   rdi obj
-            handler.write("\x48\xb8", reinterpret_cast<void*>(&do_call<F>));//mov   rax caller
-            handler.write("\xff\xd0");                                      //call  rax
+        : trampoline{std::move(func), std::bool_constant<is_stateless<F>>{}, std::false_type{}}
+    {}
 
-            //restore stack
-            handler.write("\x41\x59");                                      //pop   r9
-            handler.write("\x4c\x8b\x9c\x24", stack_size);                  //mov   r11 [rsp + on_stack]
-            handler.write("\x4c\x89\x1c\x24");                              //mov   [rsp] r11
-            handler.write("\xc3");                                          //ret
-        }
-    }
+    template <typename F>
+    trampoline(utils::static_chain_t, F func)
+        : trampoline{std::move(func), std::bool_constant<is_stateless<F>>{}, std::true_type{}}
+    {}
 
     trampoline(std::nullptr_t) noexcept
         : trampoline{}
@@ -201,10 +342,8 @@ public:
 
     trampoline& operator=(std::nullptr_t)
     {
-        if (func)
-            deleter(func);
-
-        clear();
+        trampoline tmp;
+        swap(tmp);
         return *this;
     }
 
@@ -218,34 +357,40 @@ public:
 
     explicit operator bool() const noexcept
     {
-        return func != nullptr || fptr != nullptr;
+        return fptr != nullptr;
     }
 
     R operator()(Args ... args) const
     {
-        if (func)
-            return caller(func, std::forward<Args>(args) ...);
-
-        return fptr(std::forward<Args>(args) ...);
+        return invoker(func, std::forward<Args>(args) ...);
     }
 
     R (*get() const)(Args ... arg)
     {
-        if (func)
-            return reinterpret_cast<func_ptr_t const>(code);
-
         return fptr;
     }
 
+    //the functor and the code stay intact for online readers
+    //until their grace period ends, then the functor is destroyed
     ~trampoline()
     {
-        if (func)
-            deleter(func);
+        if (code)
+        {
+            utils::thread_counters::add(utils::thread_counters::local().destroyed, 1);
+
+            auto& symbols = utils::jit_symbols::get_instance();
+            if (symbols.enabled())
+                symbols.remove(code);
+
+            utils::allocator::get_instance().deallocate(code, deleter, func);
+        }
 
-        utils::allocator::get_instance().deallocate(code);
         clear();
     }
 
+    template <typename T, typename F>
+    friend class trampoline_pool;
+
     template <typename R0, typename ... Args0>
     friend void swap_impl(trampoline<R0 (Args0 ...)>&, trampoline<R0 (Args0 ...)>&);
 
@@ -276,14 +421,14 @@ void swap_impl(trampoline<R0 (Args0 ...)>& a, trampoline<R0 (Args0 ...)>& b)
     swap(a.func, b.func);
     swap(a.fptr, b.fptr);
     swap(a.code, b.code);
-    swap(a.caller, b.caller);
+    swap(a.invoker, b.invoker);
     swap(a.deleter, b.deleter);
 }
 
 template <typename R0, typename ... Args0>
 bool operator==(trampoline<R0 (Args0 ...)> const& a, std::nullptr_t) noexcept
 {
-    return a.func == nullptr && a.fptr == nullptr;
+    return a.fptr == nullptr;
 }
 
 template <typename R0, typename ... Args0>
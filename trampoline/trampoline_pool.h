@@ -0,0 +1,157 @@
+#ifndef TRAMPOLINE_POOL_H
+#define TRAMPOLINE_POOL_H
+
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "trampoline.h"
+
+template <typename T, typename F>
+class trampoline_pool;
+
+//callback tables: up to capacity trampolines of one functor type in a single block,
+//thunks first and functors from the next page on, released all at once
+template <typename R, typename ... Args, typename F>
+class trampoline_pool<R (Args ...), F>
+{
+    using func_ptr_t    = R (*)(Args ...);
+    using owner         = trampoline<R (Args ...)>;
+
+    constexpr static auto const& proto = utils::thunk<R, Args ...>::shifting;
+
+    //thunks start on 16 byte boundaries like functions do
+    constexpr static std::size_t const stride = (proto.size + 15) / 16 * 16;
+    constexpr static std::size_t const page_size = 4096;
+
+    static_assert(alignof(F) <= page_size, "functor alignment exceeds a page");
+
+    char* code;
+    char* data;
+    std::size_t count;
+    std::size_t capacity_;
+
+    static std::size_t data_at(std::size_t capacity) noexcept
+    {
+        return (capacity * stride + page_size - 1) / page_size * page_size;
+    }
+
+    static std::size_t block_size(std::size_t capacity) noexcept
+    {
+        return data_at(capacity) + capacity * sizeof(F);
+    }
+
+    //functors are reached through the writable view only,
+    //so they may be called as non-const and never share a page with code
+    F* functor(std::size_t i) const noexcept
+    {
+        return reinterpret_cast<F*>(data + i * sizeof(F));
+    }
+
+    //run by the allocator once the block is out of every grace period
+    static void destroy_functors(void* data, std::size_t count) noexcept
+    {
+        for (std::size_t i = 0; i != count; ++i)
+            reinterpret_cast<F*>(static_cast<char*>(data) + i * sizeof(F))->~F();
+    }
+
+public:
+    explicit trampoline_pool(std::size_t capacity)
+        : code{},
+          data{},
+          count{0},
+          capacity_{capacity}
+    {
+        if (capacity == 0)
+            return;
+
+        auto& allocator = utils::allocator::get_instance();
+        code = static_cast<char*>(allocator.allocate_block(block_size(capacity)));
+        data = static_cast<char*>(allocator.writable(code)) + data_at(capacity);
+    }
+
+    //the whole range is emitted in a single pass over the block; the range is
+    //measured first, so it has to be a multi-pass one
+    template <typename ForwardIt,
+              typename = std::enable_if_t<std::is_base_of<std::forward_iterator_tag,
+                                                          typename std::iterator_traits<ForwardIt>::iterator_category>::value>>
+    trampoline_pool(ForwardIt first, ForwardIt last)
+        : trampoline_pool{static_cast<std::size_t>(std::distance(first, last))}
+    {
+        for (; first != last; ++first)
+            push_back(*first);
+    }
+
+    trampoline_pool(trampoline_pool&& that) noexcept
+        : code{std::exchange(that.code, nullptr)},
+          data{std::exchange(that.data, nullptr)},
+          count{std::exchange(that.count, 0)},
+          capacity_{std::exchange(that.capacity_, 0)}
+    {}
+
+    trampoline_pool(trampoline_pool const&)             = delete;
+    trampoline_pool& operator=(trampoline_pool const&)  = delete;
+    trampoline_pool& operator=(trampoline_pool&&)       = delete;
+
+    func_ptr_t push_back(F func)
+    {
+        if (count == capacity_)
+            throw std::bad_alloc{};
+
+        void* target = owner::template call_target<F>();
+        void* func_ptr = new (functor(count)) F(std::move(func));
+
+        char* slot = static_cast<char*>(utils::allocator::get_instance().writable(code + count * stride));
+        std::memcpy(slot, proto.code.data(), proto.size);
+        std::memcpy(slot + proto.func_at, &func_ptr, sizeof(func_ptr));
+        std::memcpy(slot + proto.target_at, &target, sizeof(target));
+
+        auto& counters = utils::thread_counters::local();
+        utils::thread_counters::add(counters.constructed, 1);
+        utils::thread_counters::add(counters.code_bytes, proto.size);
+
+        owner::template describe<F>(code + count * stride, proto);
+        return (*this)[count++];
+    }
+
+    func_ptr_t operator[](std::size_t i) const noexcept
+    {
+        return reinterpret_cast<func_ptr_t>(code + i * stride);
+    }
+
+    std::size_t size() const noexcept
+    {
+        return count;
+    }
+
+    std::size_t capacity() const noexcept
+    {
+        return capacity_;
+    }
+
+    //trivially destructible functors make teardown a single block release;
+    //functors and code are kept through the grace period of online readers
+    ~trampoline_pool()
+    {
+        if (!code)
+            return;
+
+        utils::thread_counters::add(utils::thread_counters::local().destroyed, count);
+
+        auto& symbols = utils::jit_symbols::get_instance();
+        if (symbols.enabled())
+            for (std::size_t i = 0; i != count; ++i)
+                symbols.remove(code + i * stride);
+
+        utils::allocator::destroy_block_t destroy = nullptr;
+        if constexpr (!std::is_trivially_destructible<F>::value)
+            destroy = destroy_functors;
+
+        utils::allocator::get_instance().deallocate_block(code, block_size(capacity_), destroy, data, count);
+    }
+};
+
+#endif // TRAMPOLINE_POOL_H